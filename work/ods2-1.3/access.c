@@ -21,18 +21,68 @@
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <time.h>
+#include <stdint.h>
 #include "ssdef.h"
 #include "access.h"
 #include "phyio.h"
 
+#ifdef CACHE_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#define JNL_SYNC(file) _commit(_fileno(file))
+#else
+#include <unistd.h>
+#define JNL_SYNC(file) fsync(fileno(file))
+#endif
+
+#if defined(__SSE2__) && !defined(HOST_BIG_ENDIAN) && !defined(NO_SSE2)
+#define CHECKSUM_SSE2
+#include <emmintrin.h>
+#endif
 
 #define DEBUGx
+#define PREFETCH_BLOCKS 256     /* Read ahead kept in flight for sequential files */
+#define READAHEAD_MAX 256       /* Largest read ahead window in blocks */
+#define SCAN_BLOCKS 128         /* INDEXF.SYS blocks read at once by a scan */
+#define FLUSH_BLOCKS 128        /* Largest write made from merged flush runs */
+#define DIRTY_LIMIT 512         /* Modified blocks held before writing behind */
+#define FLUSH_AGE 5             /* Seconds a modified block may wait */
+
+#define ALIGNED(addr) ((addr) + (PHYIO_ALIGN - (uintptr_t) (addr) % PHYIO_ALIGN) % PHYIO_ALIGN)
 
 
-/* checksum() to produce header checksum values... */
+/* checksum() to produce header checksum values. The sum is kept to 16
+   bits, so with SSE2 (unless built with NO_SSE2) the words are added
+   eight at a time in 16 bit lanes and the lanes summed at the end. Other
+   little endian machines add them two at a time from longwords, which
+   halves the loads and loop trips... */
 
+#ifdef CHECKSUM_SSE2
+unsigned short checksum(vmsword *block)
+{
+    register int count = 31;
+    register unsigned result;
+    register const __m128i *ptr = (const __m128i *) block;
+    register vmsword *word;
+    __m128i sum = _mm_setzero_si128();
+    do {
+        sum = _mm_add_epi16(sum,_mm_loadu_si128(ptr++));
+    } while (--count > 0);
+    sum = _mm_add_epi16(sum,_mm_srli_si128(sum,8));
+    sum = _mm_add_epi16(sum,_mm_srli_si128(sum,4));
+    sum = _mm_add_epi16(sum,_mm_srli_si128(sum,2));
+    result = _mm_cvtsi128_si32(sum) & 0xffff;
+    for (word = (vmsword *) ptr; word < block + 255; word++) result += *word;
+    return result;
+}
+#else
 unsigned short checksum(vmsword *block)
 {
+#ifdef HOST_BIG_ENDIAN
     register int count = 255;
     register unsigned result = 0;
     register unsigned short *ptr = block;
@@ -41,6 +91,32 @@ unsigned short checksum(vmsword *block)
         result += VMSWORD(data);
     } while (--count > 0);
     return result;
+#else
+    register int count = 127;
+    register unsigned result = 0;
+    register vmslong *ptr = (vmslong *) block;
+    do {
+        register vmslong data = *ptr++;
+        result += (data & 0xffff) + (data >> 16);
+    } while (--count > 0);
+    return result + block[254];
+#endif
+}
+#endif
+
+
+/* checksum_many() checks the stored checksums of count consecutive
+   blocks, setting valid[] for each which matches. Returns how many did */
+
+unsigned checksum_many(vmsword *blocks,unsigned count,unsigned char *valid)
+{
+    register unsigned block,matched = 0;
+    for (block = 0; block < count; block++) {
+        register vmsword *ptr = blocks + block * 256;
+        valid[block] = (checksum(ptr) == VMSWORD(ptr[255]));
+        matched += valid[block];
+    }
+    return matched;
 }
 
 
@@ -73,6 +149,26 @@ void fid_copy(struct fiddef *dst,struct fiddef *src,unsigned rvn)
     dst->fid$b_nmx = src->fid$b_nmx;
 }
 
+/* head_offsets() sanity check the area offsets of a header */
+
+#define head_offsets(head) ((head)->fh2$b_idoffset >= 38 && \
+        (head)->fh2$b_idoffset <= (head)->fh2$b_mpoffset && \
+        (head)->fh2$b_mpoffset <= (head)->fh2$b_acoffset && \
+        (head)->fh2$b_acoffset <= (head)->fh2$b_rsoffset && \
+        (head)->fh2$b_map_inuse <= (head)->fh2$b_acoffset - (head)->fh2$b_mpoffset)
+
+
+/* head_check() sanity check the offsets and checksum of a header */
+
+unsigned head_check(struct HEAD *head)
+{
+    if (!head_offsets(head) || checksum((vmsword *) head) != VMSWORD(head->fh2$w_checksum)) {
+        return SS$_DATACHECK;
+    }
+    return SS$_NORMAL;
+}
+
+
 /* deaccesshead() release header from INDEXF... */
 
 unsigned deaccesshead(struct VIOC *vioc,struct HEAD *head,unsigned idxblk)
@@ -124,16 +220,8 @@ unsigned accesshead(struct VCB *vcb,struct fiddef *fid,unsigned seg_num,
             /* lib$signal(SS$_NOSUCHFILE); */
             sts = SS$_NOSUCHFILE;
         } else {
-            if (head->fh2$b_idoffset < 38 ||
-                head->fh2$b_idoffset > head->fh2$b_mpoffset ||
-                head->fh2$b_mpoffset > head->fh2$b_acoffset ||
-                head->fh2$b_acoffset > head->fh2$b_rsoffset ||
-                head->fh2$b_map_inuse > head->fh2$b_acoffset - head->fh2$b_mpoffset ||
-                checksum((vmsword *) head) != VMSWORD(head->fh2$w_checksum)) {
-                sts = SS$_DATACHECK;
-            } else {
-                if (VMSWORD(head->fh2$w_seg_num) != seg_num) sts = SS$_FILESEQCHK;
-            }
+            sts = head_check(head);
+            if ((sts & 1) && VMSWORD(head->fh2$w_seg_num) != seg_num) sts = SS$_FILESEQCHK;
         }
         if ((sts & 1) == 0) deaccesschunk(*vioc,0,0,0);
     }
@@ -141,39 +229,6 @@ unsigned accesshead(struct VCB *vcb,struct fiddef *fid,unsigned seg_num,
 }
 
 
-
-
-
-struct WCBKEY {
-    unsigned vbn;
-    struct FCB *fcb;
-    struct WCB *prevwcb;
-};                              /* WCBKEY passes info to compare/create routines... */
-
-/* wcb_compare() compare two windows routine - return -1 for less, 0 for match... */
-/*    as a by product keep highest previous entry so that if a new window
-      is required we don't have to go right back to the initial file header */
-
-int wcb_compare(unsigned hashval,void *keyval,void *thiswcb)
-{
-    register struct WCBKEY *wcbkey = (struct WCBKEY *) keyval;
-    register struct WCB *wcb = (struct WCB *) thiswcb;
-    if (wcbkey->vbn < wcb->loblk) {
-        return -1;              /* Search key is less than this window maps... */
-    } else {
-        if (wcbkey->vbn <= wcb->hiblk) {
-            return 0;           /* Search key must be in this window... */
-        } else {
-            if (wcbkey->prevwcb == NULL) {
-                wcbkey->prevwcb = wcb;
-            } else {
-                if (wcb->loblk != 0 && wcb->hiblk > wcbkey->prevwcb->hiblk) wcbkey->prevwcb = wcb;
-            }
-            return 1;           /* Search key is higher than this window... */
-        }
-    }
-}
-
 /* premap_indexf() called to physically read the header for indexf.sys
    so that indexf.sys can be mapped and read into virtual cache.. */
 
@@ -209,119 +264,135 @@ struct HEAD *premap_indexf(struct FCB *fcb,unsigned *retsts)
     return head;
 }
 
-/* wcb_create() creates a window control block by reading appropriate
-   file headers... */
+/* wcb_create() maps a whole file by reading each of its headers in
+   turn. Extents are gathered in scratch arrays which grow as needed and
+   are then copied into a WCB of just the right size, so later lookups
+   never have to go back to the headers... */
 
 void *wcb_create(unsigned hashval,void *keyval,unsigned *retsts)
 {
-    register struct WCB *wcb = (struct WCB *) malloc(sizeof(struct WCB));
-    if (wcb == NULL) {
+    register struct FCB *fcb = (struct FCB *) keyval;
+    register struct WCB *wcb = NULL;
+    struct EXTENT *extent = NULL;
+    struct fiddef *hd_fid;
+    unsigned extents = 0,extmax = 0;
+    unsigned segments = 1,segmax = 4;
+    unsigned curvbn = 1;
+    struct HEAD *head = fcb->head;
+    struct HEAD *premap = NULL;
+    struct VIOC *vioc = NULL;
+    if (head == NULL) {
+        premap = head = premap_indexf(fcb,retsts);
+        if (head == NULL) return NULL;
+        head->fh2$w_ext_fid.fid$w_num = 0;
+        head->fh2$w_ext_fid.fid$b_nmx = 0;
+    }
+    hd_fid = (struct fiddef *) malloc(segmax * sizeof(struct fiddef));
+    if (hd_fid == NULL) {
+        if (premap != NULL) free(premap);
         *retsts = SS$_INSFMEM;
-    } else {
-        unsigned curvbn;
-        unsigned extents = 0;
-        struct HEAD *head;
-        struct VIOC *vioc = NULL;
-        register struct WCBKEY *wcbkey = (struct WCBKEY *) keyval;
-        wcb->cache.objmanager = NULL;
-        wcb->cache.objtype = 3;
-        if (wcbkey->prevwcb == NULL) {
-            curvbn = wcb->loblk = 1;
-            wcb->hd_seg_num = 0;
-            head = wcbkey->fcb->head;
-            if (head == NULL) {
-                head = premap_indexf(wcbkey->fcb,retsts);
-                if (head == NULL) return NULL;
-                head->fh2$w_ext_fid.fid$w_num = 0;
-                head->fh2$w_ext_fid.fid$b_nmx = 0;
-            }
-            fid_copy(&wcb->hd_fid,&head->fh2$w_fid,wcbkey->fcb->rvn);
-        } else {
-            wcb->loblk = wcbkey->prevwcb->hiblk + 1;
-            curvbn = wcbkey->prevwcb->hd_basevbn;
-            wcb->hd_seg_num = wcbkey->prevwcb->hd_seg_num;
-            memcpy(&wcb->hd_fid,&wcbkey->prevwcb->hd_fid,sizeof(struct fiddef));
-        }
-        do {
-            register unsigned short *mp;
-            register unsigned short *me;
-            wcb->hd_basevbn = curvbn;
-            if (wcb->hd_seg_num != 0) {
-                *retsts = accesshead(wcbkey->fcb->vcb,&wcb->hd_fid,wcb->hd_seg_num,&vioc,&head,NULL,0);
-                if ((*retsts & 1) == 0) {
-                    free(wcb);
-                    return NULL;
-                }
+        return NULL;
+    }
+    fid_copy(&hd_fid[0],&head->fh2$w_fid,fcb->rvn);
+    *retsts = SS$_NORMAL;
+    do {
+        register unsigned short *mp;
+        register unsigned short *me;
+        mp = (unsigned short *) head + head->fh2$b_mpoffset;
+        me = mp + head->fh2$b_map_inuse;
+        while (mp < me) {
+            register unsigned phylen,phyblk;
+            switch (VMSWORD(*mp) >> 14) {
+                case 0:
+                    phylen = 0;
+                    mp++;
+                    break;
+                case 1:
+                    phylen = (VMSWORD(*mp) & 0377) + 1;
+                    phyblk = ((VMSWORD(*mp) & 037400) << 8) | VMSWORD(mp[1]);
+                    mp += 2;
+                    break;
+                case 2:
+                    phylen = (VMSWORD(*mp) & 037777) + 1;
+                    phyblk = (VMSWORD(mp[2]) << 16) | VMSWORD(mp[1]);
+                    mp += 3;
+                    break;
+                case 3:
+                    phylen = ((VMSWORD(*mp) & 037777) << 16) + VMSWORD(mp[1]) + 1;
+                    phyblk = (VMSWORD(mp[3]) << 16) | VMSWORD(mp[2]);
+                    mp += 4;
             }
-            mp = (unsigned short *) head + head->fh2$b_mpoffset;
-            me = mp + head->fh2$b_map_inuse;
-            while (mp < me) {
-                register unsigned phylen,phyblk;
-                switch (VMSWORD(*mp) >> 14) {
-                    case 0:
-                        phylen = 0;
-                        mp++;
+            if (phylen != 0) {
+                if (extents >= extmax) {
+                    register struct EXTENT *newext;
+                    extmax = extmax ? extmax * 2 : 16;
+                    newext = (struct EXTENT *) realloc(extent,extmax * sizeof(struct EXTENT));
+                    if (newext == NULL) {
+                        *retsts = SS$_INSFMEM;
                         break;
-                    case 1:
-                        phylen = (VMSWORD(*mp) & 0377) + 1;
-                        phyblk = ((VMSWORD(*mp) & 037400) << 8) | VMSWORD(mp[1]);
-                        mp += 2;
-                        break;
-                    case 2:
-                        phylen = (VMSWORD(*mp) & 037777) + 1;
-                        phyblk = (VMSWORD(mp[2]) << 16) | VMSWORD(mp[1]);
-                        mp += 3;
-                        break;
-                    case 3:
-                        phylen = ((VMSWORD(*mp) & 037777) << 16) + VMSWORD(mp[1]) + 1;
-                        phyblk = (VMSWORD(mp[3]) << 16) | VMSWORD(mp[2]);
-                        mp += 4;
-                }
-                curvbn += phylen;
-                if (phylen != 0 && curvbn > wcb->loblk) {
-                    wcb->phylen[extents] = phylen;
-                    wcb->phyblk[extents] = phyblk;
-                    wcb->rvn[extents] = wcb->hd_fid.fid$b_rvn;
-                    if (++extents >= EXTMAX) {
-                        if (curvbn > wcbkey->vbn) {
-                            break;
-                        } else {
-                            extents = 0;
-                            wcb->loblk = curvbn;
-                        }
                     }
+                    extent = newext;
                 }
+                extent[extents].vbn = curvbn;
+                extent[extents].phyblk = phyblk;
+                extent[extents].phylen = phylen;
+                extent[extents].hd_seg_num = segments - 1;
+                extent[extents].rvn = hd_fid[segments - 1].fid$b_rvn;
+                extents++;
+                curvbn += phylen;
             }
-            if (extents >= EXTMAX || (VMSWORD(head->fh2$w_ext_fid.fid$w_num) == 0
-                                      && head->fh2$w_ext_fid.fid$b_nmx == 0)) {
+        }
+        if ((*retsts & 1) == 0 || (VMSWORD(head->fh2$w_ext_fid.fid$w_num) == 0
+                                   && head->fh2$w_ext_fid.fid$b_nmx == 0)) {
+            break;
+        }
+        if (segments >= segmax) {
+            register struct fiddef *newfid;
+            segmax *= 2;
+            newfid = (struct fiddef *) realloc(hd_fid,segmax * sizeof(struct fiddef));
+            if (newfid == NULL) {
+                *retsts = SS$_INSFMEM;
                 break;
-            } else {
-                register unsigned rvn;
-                wcb->hd_seg_num++;
-                rvn = wcb->hd_fid.fid$b_rvn;
-                fid_copy(&wcb->hd_fid,&head->fh2$w_ext_fid,rvn);
-                if (vioc != NULL) deaccesshead(vioc,NULL,0);
             }
-        } while (1);
-        if (vioc != NULL) {
-            deaccesshead(vioc,NULL,0);
-        } else {
-            if (wcbkey->fcb->head == NULL) free(head);
+            hd_fid = newfid;
         }
-        wcb->hiblk = curvbn - 1;
-        wcb->extcount = extents;
-        *retsts = SS$_NORMAL;
-        if (curvbn <= wcbkey->vbn) {
-            free(wcb);
-            *retsts = SS$_DATACHECK;
-            wcb = NULL;
+        fid_copy(&hd_fid[segments],&head->fh2$w_ext_fid,hd_fid[segments - 1].fid$b_rvn);
+        if (vioc != NULL) deaccesshead(vioc,NULL,0);
+        vioc = NULL;
+        *retsts = accesshead(fcb->vcb,&hd_fid[segments],segments,&vioc,&head,NULL,0);
+        if ((*retsts & 1) == 0) {
+            vioc = NULL;
+            break;
+        }
+        segments++;
+    } while (1);
+    if (vioc != NULL) deaccesshead(vioc,NULL,0);
+    if (premap != NULL) free(premap);
+    if (*retsts & 1) {
+        register unsigned slots = extents > 0 ? extents : 1;
+        wcb = (struct WCB *) cache_alloc(fcb->vcb->arena,3,sizeof(struct WCB) +
+                                         (slots - 1) * sizeof(struct EXTENT) +
+                                         segments * sizeof(struct fiddef));
+        if (wcb == NULL) {
+            *retsts = SS$_INSFMEM;
+        } else {
+            wcb->cache.objmanager = NULL;
+            wcb->hiblk = curvbn - 1;
+            wcb->extcount = extents;
+            wcb->segcount = segments;
+            wcb->hd_fid = (struct fiddef *) &wcb->extent[slots];
+            if (extents > 0) memcpy(wcb->extent,extent,extents * sizeof(struct EXTENT));
+            memcpy(wcb->hd_fid,hd_fid,segments * sizeof(struct fiddef));
         }
     }
+    if (extent != NULL) free(extent);
+    free(hd_fid);
     return wcb;
 }
 
 
-/* getwindow() find a window to map VBN to LBN ... */
+/* getwindow() find the extent which maps a VBN to LBN. The map is built
+   on first use and searched by binary chop from then on... */
 
 unsigned getwindow(struct FCB * fcb,unsigned vbn,struct VCBDEV **devptr,
                    unsigned *phyblk,unsigned *phylen,struct fiddef *hdrfid,
@@ -329,30 +400,35 @@ unsigned getwindow(struct FCB * fcb,unsigned vbn,struct VCBDEV **devptr,
 {
     unsigned sts;
     struct WCB *wcb;
-    struct WCBKEY wcbkey;
 #ifdef DEBUG
     printf("Accessing window for vbn %d, file (%x)\n",vbn,fcb->cache.hashval);
 #endif
-    wcbkey.vbn = vbn;
-    wcbkey.fcb = fcb;
-    wcbkey.prevwcb = NULL;
-    wcb = cache_find((void *) &fcb->wcb,0,&wcbkey,&sts,wcb_compare,wcb_create);
+    wcb = cache_find((void *) &fcb->wcb,0,fcb,&sts,NULL,wcb_create);
     if (wcb == NULL) return sts;
+    if (vbn < 1 || vbn > wcb->hiblk) {
+        cache_untouch(&wcb->cache,1);
+        return SS$_DATACHECK;
+    }
     {
-        register unsigned extent = 0;
-        register unsigned togo = vbn - wcb->loblk;
-        while (togo >= wcb->phylen[extent]) {
-            togo -= wcb->phylen[extent];
-            if (++extent > wcb->extcount) return SS$_BUGCHECK;
-        }
-        *devptr = rvn_to_dev(fcb->vcb,wcb->rvn[extent]);
-        *phyblk = wcb->phyblk[extent] + togo;
-        *phylen = wcb->phylen[extent] - togo;
-        if (hdrfid != NULL) memcpy(hdrfid,&wcb->hd_fid,sizeof(struct fiddef));
-        if (hdrseq != NULL) *hdrseq = wcb->hd_seg_num;
+        register unsigned lo = 0,hi = wcb->extcount - 1;
+        register struct EXTENT *extent;
+        while (lo < hi) {
+            register unsigned mid = (lo + hi + 1) / 2;
+            if (wcb->extent[mid].vbn <= vbn) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        extent = &wcb->extent[lo];
+        *devptr = rvn_to_dev(fcb->vcb,extent->rvn);
+        *phyblk = extent->phyblk + (vbn - extent->vbn);
+        *phylen = extent->phylen - (vbn - extent->vbn);
+        if (hdrfid != NULL) memcpy(hdrfid,&wcb->hd_fid[extent->hd_seg_num],sizeof(struct fiddef));
+        if (hdrseq != NULL) *hdrseq = extent->hd_seg_num;
 #ifdef DEBUG
-        printf("Mapping vbn %d to %d (%d -> %d)[%d] file (%x)\n",
-               vbn,*phyblk,wcb->loblk,wcb->hiblk,wcb->hd_basevbn,fcb->cache.hashval);
+        printf("Mapping vbn %d to %d (extent %d of %d) file (%x)\n",
+               vbn,*phyblk,lo,wcb->extcount,fcb->cache.hashval);
 #endif
         cache_untouch(&wcb->cache,1);
     }
@@ -361,39 +437,383 @@ unsigned getwindow(struct FCB * fcb,unsigned vbn,struct VCBDEV **devptr,
 }
 
 
+/* A write mount may journal its metadata (MOUNT/JOURNAL) in a file
+   beside the device, DEVNAM.JNL. Index file, bitmap and directory blocks
+   are appended to it as one transaction before any are written in place,
+   and the journal is emptied once they all have been. The journal is
+   synced before the writes in place start, and the device (phyio_sync())
+   before the journal is emptied, so neither can be lost to a system
+   crash while the other is relied on. Transactions only ever hold
+   whole operations (see access_begin()). A write mount which finds a complete transaction in the journal writes it out again
+   before looking at the volume. Each transaction is a JNLREC header, a
+   block number and 512 bytes for every block, and a JNLREC trailer... */
+
+struct JOURNAL {
+    FILE *file;                 /* Journal file */
+    unsigned handle;            /* Device it protects */
+    unsigned seq;               /* Last transaction number */
+    int pending;                /* Transaction waiting to be emptied */
+    char name[1];               /* Journal file name */
+};
+
+struct JNLREC {
+    char magic[4];              /* JNL_BEGIN or JNL_COMMIT */
+    unsigned seq;               /* Transaction number */
+    unsigned blocks;            /* Blocks in transaction */
+    unsigned check;             /* Sum of block numbers and data (trailer) */
+};
+
+#define JNL_BEGIN "ODSJ"
+#define JNL_COMMIT "ODSC"
+#define JNL_NAMESIZE 256        /* Room for a journal file name */
+
+int journal_trans = 0;
+int journal_blocks = 0;
+
+
+/* journal_name() makes the journal file name for a device in a buffer
+   of size bytes, cutting a long device name short to fit. Replay and
+   journal_open() both use JNL_NAMESIZE so they agree on the name */
+
+void journal_name(char *devnam,char *name,unsigned size)
+{
+    register char *end = name + size - 5;
+    while (*devnam != '\0' && *devnam != ':' && name < end) *name++ = *devnam++;
+    strcpy(name,".jnl");
+}
+
+
+/* journal_sum() adds a block into a transaction check value */
+
+unsigned journal_sum(unsigned check,unsigned lbn,char *data)
+{
+    register unsigned count = 512 / sizeof(unsigned);
+    register unsigned *ptr = (unsigned *) data;
+    check += lbn;
+    do {
+        check += *ptr++;
+    } while (--count > 0);
+    return check;
+}
+
+
+/* journal_replay() writes back any complete transactions left in the
+   journal of a device, then removes it. A transaction must fit in what
+   is left of the journal, and in the device when its size is known,
+   before any buffer is allocated for it */
+
+unsigned journal_replay(struct DEV *dev)
+{
+    register unsigned sts = SS$_NORMAL;
+    register unsigned block;
+    unsigned replayed = 0;
+    long size;
+    FILE *file;
+    char name[JNL_NAMESIZE],*buffer;
+    struct JNLREC rec,end;
+    journal_name(dev->devnam,name,sizeof(name));
+    file = fopen(name,"rb");
+    if (file == NULL) return SS$_NORMAL;
+    if (fseek(file,0,SEEK_END) != 0 || (size = ftell(file)) < 0 ||
+        fseek(file,0,SEEK_SET) != 0) {
+        fclose(file);
+        return SS$_DATACHECK;
+    }
+    buffer = NULL;
+    while (fread(&rec,sizeof(rec),1,file) == 1 &&
+           memcmp(rec.magic,JNL_BEGIN,4) == 0) {
+        register char *entry;
+        register unsigned check = 0;
+        if (rec.blocks == 0 || (dev->sectors != 0 && rec.blocks > dev->sectors) ||
+            rec.blocks > (unsigned long) (size - ftell(file)) / (sizeof(unsigned) + 512)) break;
+        if (buffer != NULL) free(buffer);
+        buffer = (char *) malloc(rec.blocks * (sizeof(unsigned) + 512) + PHYIO_ALIGN + 512);
+        if (buffer == NULL) {
+            sts = SS$_INSFMEM;
+            break;
+        }
+        if (fread(buffer,sizeof(unsigned) + 512,rec.blocks,file) != rec.blocks) break;
+        if (fread(&end,sizeof(end),1,file) != 1) break;
+        for (block = 0,entry = buffer; block < rec.blocks; block++) {
+            unsigned lbn;
+            memcpy(&lbn,entry,sizeof(unsigned));
+            check = journal_sum(check,lbn,entry + sizeof(unsigned));
+            entry += sizeof(unsigned) + 512;
+        }
+        if (memcmp(end.magic,JNL_COMMIT,4) != 0 || end.seq != rec.seq ||
+            end.blocks != rec.blocks || end.check != check) break;
+        for (block = 0,entry = buffer; block < rec.blocks; block++) {
+            register char *aligned = ALIGNED(buffer + rec.blocks * (sizeof(unsigned) + 512));
+            unsigned lbn;
+            memcpy(&lbn,entry,sizeof(unsigned));
+            memcpy(aligned,entry + sizeof(unsigned),512);
+            sts = phyio_write(dev->handle,lbn,512,aligned);
+            if ((sts & 1) == 0) break;
+            entry += sizeof(unsigned) + 512;
+        }
+        if ((sts & 1) == 0) break;
+        replayed += rec.blocks;
+    }
+    if (buffer != NULL) free(buffer);
+    fclose(file);
+    if ((sts & 1) && replayed) sts = phyio_sync(dev->handle);
+    if (sts & 1) {
+        if (replayed) printf("%%MOUNT-I-REPLAYED, %d blocks replayed from %s\n",replayed,name);
+        remove(name);
+    }
+    return sts;
+}
+
+
+/* journal_open() starts an empty journal for a device */
+
+struct JOURNAL *journal_open(struct DEV *dev)
+{
+    register struct JOURNAL *journal;
+    journal = (struct JOURNAL *) malloc(sizeof(struct JOURNAL) + JNL_NAMESIZE);
+    if (journal != NULL) {
+        journal_name(dev->devnam,journal->name,JNL_NAMESIZE);
+        journal->file = fopen(journal->name,"wb");
+        if (journal->file == NULL) {
+            free(journal);
+            return NULL;
+        }
+        journal->handle = dev->handle;
+        journal->seq = 0;
+        journal->pending = 0;
+    }
+    return journal;
+}
+
+
+/* journal_close() closes and removes an (empty) journal */
+
+void journal_close(struct JOURNAL *journal)
+{
+    fclose(journal->file);
+    if (!journal->pending) remove(journal->name);
+    free(journal);
+}
+
+
+/* journal_reset() empties a journal once its blocks are all written -
+   and have reached the device, so they are synced first */
+
+unsigned journal_reset(struct JOURNAL *journal)
+{
+    register unsigned sts = phyio_sync(journal->handle);
+    if (!(sts & 1)) return sts;
+    journal->pending = 0;
+    journal->file = freopen(journal->name,"wb",journal->file);
+    if (journal->file == NULL) return SS$_WRITLCK;
+    return SS$_NORMAL;
+}
+
+
+/* Write back is gathered: while access_flush() is running vioc_manager()
+   queues each run of modified blocks instead of writing it. The queue is
+   then sorted by device and LBN, runs which meet on disk are copied
+   together and written with one transfer, and only then are the VIOCs
+   marked clean... */
+
+struct FLUSHRUN {
+    unsigned handle;            /* Device to write */
+    unsigned phyblk;            /* Starting LBN */
+    unsigned length;            /* Blocks in run (0 if cancelled) */
+    char *address;              /* Data to write */
+    struct VIOC *vioc;          /* VIOC the data belongs to */
+    struct JOURNAL *journal;    /* Journal to log run in (or NULL) */
+};
+
+struct FLUSHRUN *flush_run = NULL;      /* Queue of runs being gathered */
+unsigned flush_queued = 0;
+unsigned flush_max = 0;
+int flush_gather = 0;
+
+/* Some statistical counters... */
+
+int flush_count = 0;
+int flush_behind = 0;
+int flush_runs = 0;
+int flush_writes = 0;
+int flush_blocks = 0;
+
+/* Modified blocks are counted so that deaccesschunk() can write them
+   behind the caller: when DIRTY_LIMIT more have built up than were left
+   by the last flush (those belong to VIOCs still in use), or the first
+   has waited FLUSH_AGE seconds, everything is flushed together. These
+   counters and the flush queue are shared by every context, so they are
+   only changed while holding the cache lock (see cache_lock()).
+
+   Built with CACHE_THREADS the flush is made by a thread of its own,
+   started when a block is first modified, so that the caller which
+   crosses DIRTY_LIMIT doesn't make it while holding up everyone else,
+   and an old block goes out even when nothing else is modified. Without
+   threads the caller which finds a flush due makes it */
+
+#if defined(CACHE_THREADS) && !defined(NO_WRITEBEHIND)
+#define FLUSH_THREAD
+
+pthread_once_t flush_once = PTHREAD_ONCE_INIT;
+int flush_running = 0;          /* Flush thread has started */
+int flush_idle = 0;             /* ...and waits for a modified block */
+#endif
+
+unsigned access_dirty = 0;      /* Modified blocks in cache */
+unsigned dirty_base = 0;        /* ...left over by the last flush */
+time_t dirty_since = 0;         /* When the first of the rest was modified */
+
+/* A change to the volume (creating, extending or deleting a file, or
+   a directory entry) is an operation, and is opened by access_begin()
+   and closed by access_end(). Operations hold the cache lock, so that
+   two of them can't allocate the same header or clusters, and they may
+   nest. While one is open nothing is written behind and modified
+   metadata is not evicted, so a flush - and so a journal transaction -
+   only ever holds whole operations */
+
+unsigned access_ops = 0;        /* Operations open */
+
+
+/* access_show() - to print write back statistics */
+
+void access_show(void)
+{
+    printf("ACCESS_SHOW Flushes: %d (%d behind) Runs: %d Writes: %d Blocks: %d Dirty: %d\n",
+           flush_count,flush_behind,flush_runs,flush_writes,flush_blocks,access_dirty);
+    if (journal_trans) printf(" - Journal transactions: %d Blocks: %d\n",journal_trans,journal_blocks);
+}
+
+
+/* vioc_clean() mark a VIOC as written */
+
+void vioc_clean(struct VIOC *vioc)
+{
+    register int mask;
+    for (mask = 0; mask < VIOC_MASKS; mask++) {
+        register unsigned bits = vioc->modmask[mask];
+        while (bits != 0) {
+            bits &= bits - 1;
+            access_dirty--;
+        }
+        vioc->modmask[mask] = 0;
+    }
+    if (dirty_base > access_dirty) dirty_base = access_dirty;
+    vioc->cache.objmanager = NULL;
+}
+
+
+/* journal_log() appends the journalled runs in a list to the journal
+   as one transaction */
+
+unsigned journal_log(struct JOURNAL *journal,struct FLUSHRUN *run,unsigned count)
+{
+    register unsigned block;
+    struct JNLREC rec;
+    memcpy(rec.magic,JNL_BEGIN,4);
+    rec.seq = ++journal->seq;
+    rec.blocks = 0;
+    rec.check = 0;
+    for (block = 0; block < count; block++) {
+        if (run[block].journal == journal) rec.blocks += run[block].length;
+    }
+    if (rec.blocks == 0) return SS$_NORMAL;
+    journal->pending = 1;
+    if (fwrite(&rec,sizeof(rec),1,journal->file) != 1) return SS$_WRITLCK;
+    for (; count > 0; run++,count--) {
+        if (run->journal == journal) {
+            register char *address = run->address;
+            unsigned lbn;
+            for (lbn = run->phyblk; lbn < run->phyblk + run->length; lbn++) {
+                rec.check = journal_sum(rec.check,lbn,address);
+                if (fwrite(&lbn,sizeof(lbn),1,journal->file) != 1 ||
+                    fwrite(address,512,1,journal->file) != 1) return SS$_WRITLCK;
+                address += 512;
+            }
+        }
+    }
+    memcpy(rec.magic,JNL_COMMIT,4);
+    if (fwrite(&rec,sizeof(rec),1,journal->file) != 1) return SS$_WRITLCK;
+    if (fflush(journal->file) != 0 || JNL_SYNC(journal->file) != 0) return SS$_WRITLCK;
+    journal_trans++;
+    journal_blocks += rec.blocks;
+    return SS$_NORMAL;
+}
+
+
+/* vioc_write() write (or queue) one run of blocks from a VIOC. Only
+   file data is written alone: metadata is always gathered, so that it
+   can be journalled with the rest of its transaction */
+
+unsigned vioc_write(struct VIOC *vioc,unsigned handle,struct JOURNAL *journal,
+                    unsigned phyblk,unsigned length,char *address,int flushonly)
+{
+    if (flush_gather) {
+        if (flushonly) {
+            if (flush_queued >= flush_max) {
+                register unsigned newmax = flush_max ? flush_max * 2 : 64;
+                register struct FLUSHRUN *newrun;
+                newrun = (struct FLUSHRUN *) realloc(flush_run,newmax * sizeof(struct FLUSHRUN));
+                if (newrun == NULL) return SS$_INSFMEM;
+                flush_run = newrun;
+                flush_max = newmax;
+            }
+            flush_run[flush_queued].handle = handle;
+            flush_run[flush_queued].phyblk = phyblk;
+            flush_run[flush_queued].length = length;
+            flush_run[flush_queued].address = address;
+            flush_run[flush_queued].vioc = vioc;
+            flush_run[flush_queued].journal = journal;
+            flush_queued++;
+            return SS$_NORMAL;
+        } else {
+            register unsigned run;      /* VIOC is going: forget its runs */
+            for (run = 0; run < flush_queued; run++) {
+                if (flush_run[run].vioc == vioc) flush_run[run].length = 0;
+            }
+        }
+    }
+    flush_runs++;
+    flush_writes++;
+    flush_blocks += length;
+    return phyio_write(handle,phyblk,length * 512,address);
+}
+
+
 /* Object manager for VIOC objects:- if the object has been
    modified then we need to flush it to disk before we let
-   the cache routines do anything to it... */
+   the cache routines do anything to it... Modified metadata
+   can only be deleted by flushing everything, and not at all
+   while an operation is open or a flush is being gathered */
 
 void *vioc_manager(struct CACHE * cacheobj,int flushonly)
 {
     register struct VIOC *vioc = (struct VIOC *) cacheobj;
-    if (vioc->modmask != 0) {
+    register int mask;
+    for (mask = 0; mask < VIOC_MASKS; mask++) if (vioc->modmask[mask] != 0) break;
+    if (mask < VIOC_MASKS) {
         register struct FCB *fcb = vioc->fcb;
-        register int length = VIOC_CHUNKSIZE;
-        register unsigned curvbn = vioc->cache.hashval + 1;
-        register char *address = (char *) vioc->data;
-        register unsigned modmask = vioc->modmask;
-        printf("\nvioc_manager writing vbn %d\n",curvbn);
-        do {
+        register unsigned block = 0;
+        register int metadata = (fcb->status & FCB_METADATA) != 0;
+        if (metadata && !flushonly) {
+            if (flush_gather || access_ops > 0) return NULL;
+            if ((access_flush() & 1) == 0) return NULL;
+            return cacheobj;
+        }
+        while (block < fcb->chunksize) {
             register unsigned sts;
-            int wrtlen = 0;
+            register unsigned curvbn;
+            register char *address;
+            unsigned wrtlen = 0;
             unsigned phyblk,phylen;
             struct VCBDEV *vcbdev;
-            while (length > 0 && (1 & modmask) == 0) {
-                length--;
-                curvbn++;
-                address += 512;
-                modmask = modmask >> 1;
-            }
-            while (wrtlen < length && (1 & modmask) != 0) {
-                wrtlen++;
-                modmask = modmask >> 1;
-            }
-            length -= wrtlen;
+            while (block < fcb->chunksize && !VIOC_BIT(vioc->modmask,block)) block++;
+            while (block + wrtlen < fcb->chunksize && VIOC_BIT(vioc->modmask,block + wrtlen)) wrtlen++;
+            curvbn = vioc->cache.hashval + 1 + block;
+            address = vioc->address + block * 512;
+            block += wrtlen;
             while (wrtlen > 0) {
                 if (fcb->highwater != 0 && curvbn >= fcb->highwater) {
-                    length = 0;
+                    block = fcb->chunksize;
                     break;
                 }
                 sts = getwindow(fcb,curvbn,&vcbdev,&phyblk,&phylen,NULL,NULL);
@@ -402,20 +822,201 @@ void *vioc_manager(struct CACHE * cacheobj,int flushonly)
                 if (fcb->highwater != 0 && curvbn + phylen > fcb->highwater) {
                     phylen = fcb->highwater - curvbn;
                 }
-                sts = phyio_write(vcbdev->dev->handle,phyblk,phylen * 512,address);
+                sts = vioc_write(vioc,vcbdev->dev->handle,metadata ? vcbdev->journal : NULL,
+                                 phyblk,phylen,address,flushonly);
                 if (!(sts & 1)) return NULL;
                 wrtlen -= phylen;
                 curvbn += phylen;
                 address += phylen * 512;
             }
-        } while (length > 0 && modmask != 0);
-        vioc->modmask = 0;
-        vioc->cache.objmanager = NULL;
+        }
+        if (flush_gather && flushonly) return cacheobj;
+        vioc_clean(vioc);
     }
     return cacheobj;
 }
 
 
+/* flush_compare() orders flush runs by device and then LBN */
+
+int flush_compare(const void *run1,const void *run2)
+{
+    register const struct FLUSHRUN *r1 = (const struct FLUSHRUN *) run1;
+    register const struct FLUSHRUN *r2 = (const struct FLUSHRUN *) run2;
+    if (r1->handle != r2->handle) return r1->handle < r2->handle ? -1 : 1;
+    if (r1->phyblk != r2->phyblk) return r1->phyblk < r2->phyblk ? -1 : 1;
+    return 0;
+}
+
+
+/* access_flush() write back every modified VIOC in LBN order, merging
+   runs which are adjacent on disk into single writes of up to
+   FLUSH_BLOCKS blocks... */
+
+unsigned access_flush(void)
+{
+    register unsigned sts = SS$_NORMAL;
+    register unsigned run,next;
+    struct JOURNAL *logged = NULL;
+    char *buffer = NULL;
+    cache_lock();
+    flush_count++;
+    flush_queued = 0;
+    flush_gather = 1;
+    cache_flush();
+    flush_gather = 0;
+    if (flush_queued > 1) qsort(flush_run,flush_queued,sizeof(struct FLUSHRUN),flush_compare);
+    for (run = 0; run < flush_queued; run++) {
+        register struct JOURNAL *journal = flush_run[run].journal;
+        if (journal != NULL && journal != logged) {
+            sts = journal_log(journal,flush_run + run,flush_queued - run);
+            if ((sts & 1) == 0) break;
+            logged = journal;
+        }
+    }
+    for (run = 0; run < flush_queued && (sts & 1); run = next) {
+        register unsigned length = flush_run[run].length;
+        if (length == 0) {
+            next = run + 1;
+            continue;
+        }
+        for (next = run + 1; next < flush_queued; next++) {
+            if (flush_run[next].length == 0) continue;
+            if (flush_run[next].handle != flush_run[run].handle ||
+                flush_run[next].phyblk != flush_run[run].phyblk + length ||
+                length + flush_run[next].length > FLUSH_BLOCKS) break;
+            length += flush_run[next].length;
+        }
+        flush_runs += next - run;
+        flush_writes++;
+        flush_blocks += length;
+        if (length == flush_run[run].length) {
+            sts = phyio_write(flush_run[run].handle,flush_run[run].phyblk,
+                              length * 512,flush_run[run].address);
+        } else {
+            register unsigned merge;
+            register char *address;
+            if (buffer == NULL) {
+                buffer = (char *) malloc(FLUSH_BLOCKS * 512 + PHYIO_ALIGN);
+                if (buffer == NULL) {
+                    sts = SS$_INSFMEM;
+                    break;
+                }
+            }
+            address = ALIGNED(buffer);
+            for (merge = run; merge < next; merge++) {
+                memcpy(address,flush_run[merge].address,flush_run[merge].length * 512);
+                address += flush_run[merge].length * 512;
+            }
+            sts = phyio_write(flush_run[run].handle,flush_run[run].phyblk,
+                              length * 512,ALIGNED(buffer));
+        }
+        if (!(sts & 1)) break;
+    }
+    if (buffer != NULL) free(buffer);
+
+    /* If everything went out the VIOCs are clean (else they stay dirty
+       to be written again by the next flush or when they are deleted) */
+
+    if (sts & 1) {
+        for (run = 0; run < flush_queued; run++) {
+            register struct VIOC *vioc = flush_run[run].vioc;
+            if (flush_run[run].length != 0) vioc_clean(vioc);
+            if (flush_run[run].journal != NULL && flush_run[run].journal->pending) {
+                sts = journal_reset(flush_run[run].journal);
+            }
+        }
+    }
+    flush_queued = 0;
+    dirty_base = access_dirty;
+    cache_unlock();
+    return sts;
+}
+
+
+/* flush_due() is true when enough blocks have been modified, or have
+   been for long enough - and no operation is open, in which case
+   access_end() will look again */
+
+int flush_due(void)
+{
+    return !flush_gather && access_ops == 0 && access_dirty > dirty_base &&
+        (access_dirty - dirty_base >= DIRTY_LIMIT || time(NULL) - dirty_since >= FLUSH_AGE);
+}
+
+
+#ifdef FLUSH_THREAD
+
+/* flush_thread() writes behind for every context. It waits for a
+   modified block, then for up to FLUSH_AGE seconds at a time until a
+   flush is due */
+
+void *flush_thread(void *arg)
+{
+    cache_lock();
+    while (1) {
+        if (flush_due()) {
+            flush_behind++;
+            access_flush();
+        }
+        flush_idle = access_dirty <= dirty_base;
+        cache_wait(flush_idle ? 0 : FLUSH_AGE);
+    }
+    return NULL;
+}
+
+void flush_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,flush_thread,NULL) == 0) {
+        pthread_detach(thread);
+        flush_running = 1;
+        flush_idle = 1;
+    }
+}
+#endif
+
+
+/* access_behind() has blocks written behind the caller: by waking the
+   flush thread, or by flushing them here when there isn't one */
+
+void access_behind(void)
+{
+#ifdef FLUSH_THREAD
+    if (access_dirty > dirty_base) pthread_once(&flush_once,flush_start);
+    if (flush_running) {
+        if ((flush_idle && access_dirty > dirty_base) || flush_due()) cache_wake();
+        return;
+    }
+#endif
+#ifndef NO_WRITEBEHIND
+    if (flush_due()) {
+        flush_behind++;
+        access_flush();
+    }
+#endif
+}
+
+
+/* access_begin() opens an operation (see access_ops) */
+
+void access_begin(void)
+{
+    cache_lock();
+    access_ops++;
+}
+
+
+/* access_end() closes an operation, and writes behind if the last one
+   left enough behind it */
+
+void access_end(void)
+{
+    if (--access_ops == 0) access_behind();
+    cache_unlock();
+}
+
+
 /* deaccesschunk() to deaccess a VIOC (chunk of a file) */
 
 unsigned deaccesschunk(struct VIOC *vioc,unsigned wrtvbn,
@@ -425,67 +1026,378 @@ unsigned deaccesschunk(struct VIOC *vioc,unsigned wrtvbn,
     printf("Deaccess chunk %8x\n",vioc->cache.hashval);
 #endif
     if (wrtvbn) {
-        register unsigned modmask;
+        register unsigned block,first;
         if (wrtvbn <= vioc->cache.hashval ||
-            wrtvbn + wrtblks > vioc->cache.hashval + VIOC_CHUNKSIZE + 1) {
+            wrtvbn + wrtblks > vioc->cache.hashval + vioc->fcb->chunksize + 1) {
 	     return SS$_BADPARAM;
 	}
-        modmask = 1 << (wrtvbn - vioc->cache.hashval - 1);
-        while (--wrtblks > 0) modmask |= modmask << 1;
-        if ((vioc->wrtmask | modmask) != vioc->wrtmask) return SS$_WRITLCK;
-        vioc->modmask |= modmask;
-        if (vioc->cache.refcount == 1) vioc->wrtmask = 0;
+        first = wrtvbn - vioc->cache.hashval - 1;
+        for (block = first; block < first + wrtblks; block++) {
+            if (!VIOC_BIT(vioc->wrtmask,block)) return SS$_WRITLCK;
+        }
+        cache_lock();
+        for (block = first; block < first + wrtblks; block++) {
+            if (!VIOC_BIT(vioc->modmask,block)) {
+                VIOC_SETBIT(vioc->modmask,block);
+                if (access_dirty++ == dirty_base) dirty_since = time(NULL);
+            }
+        }
+        if (vioc->cache.refcount == 1) memset(vioc->wrtmask,0,sizeof(vioc->wrtmask));
         vioc->cache.objmanager = vioc_manager;
+        cache_untouch(&vioc->cache,reuse);
+        access_behind();
+        cache_unlock();
+        return SS$_NORMAL;
     }
     cache_untouch(&vioc->cache,reuse);
     return SS$_NORMAL;
 }
 
 
+/* access_prefetch() asks the physical I/O layer to start reading the
+   blocks of a file ahead of the caller - one request per extent... */
+
+void access_prefetch(struct FCB *fcb,unsigned vbn,unsigned blocks)
+{
+    register unsigned endvbn = vbn + blocks;
+    if (endvbn > fcb->hiblock + 1) endvbn = fcb->hiblock + 1;
+    if (fcb->highwater != 0 && endvbn > fcb->highwater) endvbn = fcb->highwater;
+    if (vbn < fcb->prefetch) vbn = fcb->prefetch;
+    while (vbn < endvbn) {
+        unsigned phyblk,phylen;
+        struct VCBDEV *vcbdev;
+        if ((getwindow(fcb,vbn,&vcbdev,&phyblk,&phylen,NULL,NULL) & 1) == 0) break;
+        if (phylen > endvbn - vbn) phylen = endvbn - vbn;
+        phyio_prefetch(vcbdev->dev->handle,phyblk,phylen * 512);
+        vbn += phylen;
+    }
+    if (vbn > fcb->prefetch) fcb->prefetch = vbn;
+}
+
+
+/* vioc_map() returns the device mapping address for a chunk if the
+   whole chunk lies within one extent of a mapped volume... */
+
+char *vioc_map(struct FCB *fcb,unsigned curvbn,unsigned length)
+{
+    unsigned phyblk,phylen;
+    struct VCBDEV *vcbdev;
+    if ((fcb->vcb->status & VCB_MAPPED) == 0 || (fcb->status & FCB_WRITE)) return NULL;
+    if (fcb->highwater != 0 && curvbn + length > fcb->highwater) return NULL;
+    if ((getwindow(fcb,curvbn,&vcbdev,&phyblk,&phylen,NULL,NULL) & 1) == 0) return NULL;
+    if (phylen < length) return NULL;
+    return phyio_mapaddr(vcbdev->dev->handle,phyblk,length * 512);
+}
+
+
+/* A VIOC is read outside the cache lock. vioc_create() only makes an
+   empty one, and accesschunk() has vioc_load() fill it: the transfers
+   are planned holding the cache lock (they need the file map and the
+   read ahead state), then the VIOC is claimed and they are made without
+   it. Anyone else after the chunk meanwhile waits for the claim to end.
+   Claims and waits use one of LOAD_STRIPES small locks picked by the
+   VIOC address rather than the cache lock, so a thread which holds the
+   cache lock (making a file window, say) can still wait for a load, as
+   that needs nothing more than the device. */
+
+struct LOADPLAN {
+    unsigned curvbn;            /* First vbn of chunk */
+    unsigned length;            /* Blocks to fill */
+    unsigned runs;              /* Transfers to fill them... */
+    struct {
+        unsigned handle;
+        unsigned phyblk;
+        unsigned length;
+    } run[VIOC_CHUNKMAX];
+    unsigned zero;              /* Blocks past high water to clear */
+    char *rabuffer;             /* Read ahead buffer taken from the FCB */
+    unsigned ravbn;             /* First vbn it holds (or is to hold) */
+    unsigned rablocks;          /* Blocks it holds (or is to hold) */
+    int raread;                 /* Read ahead to be made from... */
+    unsigned rahandle;          /* ...this device */
+    unsigned raphyblk;          /* ...and LBN */
+};
+
+#ifdef CACHE_THREADS
+#define LOAD_STRIPES 16
+
+struct LOADLOCK {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} loadlocks[LOAD_STRIPES];
+pthread_once_t loadonce = PTHREAD_ONCE_INIT;
+
+void load_lockinit(void)
+{
+    register int stripe;
+    for (stripe = 0; stripe < LOAD_STRIPES; stripe++) {
+        pthread_mutex_init(&loadlocks[stripe].lock,NULL);
+        pthread_cond_init(&loadlocks[stripe].done,NULL);
+    }
+}
+
+#define LOAD_STRIPE(vioc) (&loadlocks[(uintptr_t) (vioc) / 64 % LOAD_STRIPES])
+#define LOAD_LOCK(load) (pthread_once(&loadonce,load_lockinit),pthread_mutex_lock(&(load)->lock))
+#define LOAD_UNLOCK(load) pthread_mutex_unlock(&(load)->lock)
+#define LOAD_WAIT(load) pthread_cond_wait(&(load)->done,&(load)->lock)
+#define LOAD_WAKE(load) pthread_cond_broadcast(&(load)->done)
+#else
+#define LOAD_STRIPE(vioc) NULL
+#define LOAD_LOCK(load)
+#define LOAD_UNLOCK(load)
+#define LOAD_WAIT(load)
+#define LOAD_WAKE(load)
+#endif
+
+
+/* vioc_readahead() watches for chunks of a file being loaded in vbn
+   order. While that continues a read ahead window is doubled on each
+   refill (up to READAHEAD_MAX blocks) and read with a single transfer,
+   so that the following chunks are filled from the buffer. Random access
+   shrinks the window back to one chunk. The buffer is taken from the FCB
+   into the plan, to be read and copied from without the cache lock, and
+   vioc_endload() gives it back. Returns 1 if the chunk will come from the
+   buffer... */
+
+int vioc_readahead(struct FCB *fcb,struct LOADPLAN *plan)
+{
+    register unsigned ralen;
+    register unsigned curvbn = plan->curvbn,length = plan->length;
+    unsigned phyblk,phylen;
+    struct VCBDEV *vcbdev;
+    if (fcb->rabuffer != NULL && curvbn >= fcb->ravbn &&
+        curvbn + length <= fcb->ravbn + fcb->rablocks) {
+        plan->rabuffer = fcb->rabuffer;
+        plan->ravbn = fcb->ravbn;
+        plan->rablocks = fcb->rablocks;
+        plan->raread = 0;
+        fcb->rabuffer = NULL;
+        fcb->rablocks = 0;
+        fcb->ranext = curvbn + length;
+        return 1;
+    }
+    if (curvbn == fcb->ranext) {
+        fcb->rawindow *= 2;
+        if (fcb->rawindow > READAHEAD_MAX) fcb->rawindow = READAHEAD_MAX;
+    } else {
+        fcb->rawindow = fcb->chunksize;
+    }
+    fcb->ranext = curvbn + length;
+    ralen = fcb->rawindow;
+    if (ralen > fcb->hiblock - curvbn + 1) ralen = fcb->hiblock - curvbn + 1;
+    if (fcb->highwater != 0) {
+        if (curvbn >= fcb->highwater) return 0;
+        if (curvbn + ralen > fcb->highwater) ralen = fcb->highwater - curvbn;
+    }
+    if (ralen <= length) return 0;
+    if ((getwindow(fcb,curvbn,&vcbdev,&phyblk,&phylen,NULL,NULL) & 1) == 0) return 0;
+    if (ralen > phylen) ralen = phylen;
+    if (ralen <= length) return 0;
+    plan->rabuffer = fcb->rabuffer;
+    if (plan->rabuffer == NULL) {
+        plan->rabuffer = (char *) malloc(READAHEAD_MAX * 512 + PHYIO_ALIGN);
+        if (plan->rabuffer == NULL) return 0;
+    }
+    fcb->rabuffer = NULL;
+    fcb->rablocks = 0;
+    plan->ravbn = curvbn;
+    plan->rablocks = ralen;
+    plan->raread = 1;
+    plan->rahandle = vcbdev->dev->handle;
+    plan->raphyblk = phyblk;
+    return 1;
+}
+
+
+/* vioc_endreadahead() drops the read ahead buffer of a file... */
+
+void vioc_endreadahead(struct FCB *fcb)
+{
+    cache_lock();
+    if (fcb->rabuffer != NULL) {
+        free(fcb->rabuffer);
+        fcb->rabuffer = NULL;
+    }
+    fcb->rablocks = 0;
+    fcb->ranext = 0;
+    fcb->rawindow = fcb->chunksize;
+    cache_unlock();
+}
+
+
+/* vioc_plan() works out the transfers to fill a VIOC, holding the cache
+   lock. The chunk is read directly even when it is to come from read
+   ahead, in case the read ahead fails */
+
+unsigned vioc_plan(struct VIOC *vioc,struct LOADPLAN *plan)
+{
+    register struct FCB *fcb = vioc->fcb;
+    register unsigned curvbn = vioc->cache.hashval + 1;
+    register unsigned length;
+    plan->rabuffer = NULL;
+    plan->runs = 0;
+    plan->zero = 0;
+    length = fcb->hiblock - curvbn + 1;
+    if (length > fcb->chunksize) length = fcb->chunksize;
+    plan->curvbn = curvbn;
+    plan->length = length;
+    if ((fcb->status & FCB_WRITE) == 0 && vioc_readahead(fcb,plan) && !plan->raread) {
+        return SS$_NORMAL;
+    }
+    while (length > 0) {
+        register unsigned sts;
+        unsigned phyblk,phylen;
+        struct VCBDEV *vcbdev;
+        if (fcb->highwater != 0 && curvbn >= fcb->highwater) {
+            plan->zero = length;
+            break;
+        }
+        sts = getwindow(fcb,curvbn,&vcbdev,&phyblk,&phylen,NULL,NULL);
+        if ((sts & 1) == 0) return sts;
+        if (phylen > length) phylen = length;
+        if (fcb->highwater != 0 && curvbn + phylen > fcb->highwater) {
+            phylen = fcb->highwater - curvbn;
+        }
+        plan->run[plan->runs].handle = vcbdev->dev->handle;
+        plan->run[plan->runs].phyblk = phyblk;
+        plan->run[plan->runs].length = phylen;
+        plan->runs++;
+        length -= phylen;
+        curvbn += phylen;
+    }
+    return SS$_NORMAL;
+}
+
+
+/* vioc_fill() makes the transfers of a plan into a VIOC (without the
+   cache lock) */
+
+unsigned vioc_fill(struct VIOC *vioc,struct LOADPLAN *plan)
+{
+    register char *address = vioc->address;
+    register unsigned run;
+    if (plan->rabuffer != NULL) {
+        if (plan->raread &&
+            (phyio_read(plan->rahandle,plan->raphyblk,plan->rablocks * 512,
+                        ALIGNED(plan->rabuffer)) & 1)) {
+            plan->raread = 0;
+        }
+        if (!plan->raread) {
+            memcpy(address,ALIGNED(plan->rabuffer) + (plan->curvbn - plan->ravbn) * 512,
+                   plan->length * 512);
+            return SS$_NORMAL;
+        }
+    }
+    for (run = 0; run < plan->runs; run++) {
+        register unsigned sts;
+        sts = phyio_read(plan->run[run].handle,plan->run[run].phyblk,
+                         plan->run[run].length * 512,address);
+        if ((sts & 1) == 0) return sts;
+        address += plan->run[run].length * 512;
+    }
+    if (plan->zero) memset(address,0,plan->zero * 512);
+    return SS$_NORMAL;
+}
+
+
+/* vioc_endload() gives the read ahead buffer back to the FCB (empty if
+   the read ahead wasn't made) - unless it has found another meanwhile,
+   or is now open for write */
+
+void vioc_endload(struct FCB *fcb,struct LOADPLAN *plan)
+{
+    if (plan->rabuffer != NULL) {
+        cache_lock();
+        if (fcb->rabuffer == NULL && (fcb->status & FCB_WRITE) == 0) {
+            fcb->rabuffer = plan->rabuffer;
+            fcb->ravbn = plan->ravbn;
+            fcb->rablocks = plan->raread ? 0 : plan->rablocks;
+        } else {
+            free(plan->rabuffer);
+        }
+        cache_unlock();
+    }
+}
+
+
+/* vioc_load() makes sure a VIOC has been read: by reading it, or by
+   waiting for whoever is */
+
+unsigned vioc_load(struct VIOC *vioc)
+{
+    register unsigned sts;
+    struct LOADPLAN plan;
+#ifdef CACHE_THREADS
+    register struct LOADLOCK *load = LOAD_STRIPE(vioc);
+#endif
+    LOAD_LOCK(load);
+    sts = vioc->state;
+    LOAD_UNLOCK(load);
+    if (sts == VIOC_READY) return SS$_NORMAL;
+    cache_lock();
+    sts = vioc_plan(vioc,&plan);
+    cache_unlock();
+    if ((sts & 1) == 0) {
+        vioc_endload(vioc->fcb,&plan);
+        return sts;
+    }
+    LOAD_LOCK(load);
+    while (vioc->state == VIOC_LOADING) LOAD_WAIT(load);
+    if (vioc->state == VIOC_READY) {
+        LOAD_UNLOCK(load);
+        vioc_endload(vioc->fcb,&plan);
+        return SS$_NORMAL;
+    }
+    vioc->state = VIOC_LOADING;
+    LOAD_UNLOCK(load);
+    sts = vioc_fill(vioc,&plan);
+    LOAD_LOCK(load);
+    vioc->state = (sts & 1) ? VIOC_READY : VIOC_EMPTY;
+    LOAD_WAKE(load);
+    LOAD_UNLOCK(load);
+    vioc_endload(vioc->fcb,&plan);
+    return sts;
+}
+
+
+/* vioc_create() makes an empty VIOC for vioc_load() to fill - or one
+   which is ready if the volume is mapped */
+
 void *vioc_create(unsigned hashval,void *keyval,unsigned *retsts)
 {
-    register struct VIOC *vioc = (struct VIOC *) malloc(sizeof(struct VIOC));
+    register struct VIOC *vioc;
+    register int length;
+    register unsigned curvbn = hashval + 1;
+    register struct FCB *fcb = (struct FCB *) keyval;
+    register unsigned size = VIOC_MAPSIZE;
+    char *mapaddr;
+    length = fcb->hiblock - curvbn + 1;
+    if (length > fcb->chunksize) length = fcb->chunksize;
+    mapaddr = vioc_map(fcb,curvbn,length);
+    if (mapaddr == NULL) {
+        size += fcb->chunksize * 512;
+        if (fcb->vcb->status & VCB_DIRECT) size += PHYIO_ALIGN;
+    }
+    vioc = (struct VIOC *) cache_alloc(fcb->vcb->arena,7,size);
     if (vioc == NULL) {
         *retsts = SS$_INSFMEM;
     } else {
-        register int length;
-        register unsigned curvbn = hashval + 1;
-        register char *address;
-        register struct FCB *fcb = (struct FCB *) keyval;
         vioc->cache.objmanager = NULL;
-        vioc->cache.objtype = 7;
         vioc->fcb = fcb;
-        vioc->wrtmask = 0;
-        vioc->modmask = 0;
-        length = fcb->hiblock - curvbn + 1;
-        if (length > VIOC_CHUNKSIZE) length = VIOC_CHUNKSIZE;
-        address = (char *) vioc->data;
-        do {
-            if (fcb->highwater != 0 && curvbn >= fcb->highwater) {
-                memset(address,0,length * 512);
-                break;
-            } else {
-                register unsigned sts;
-                unsigned phyblk,phylen;
-                struct VCBDEV *vcbdev;
-                sts = getwindow(fcb,curvbn,&vcbdev,&phyblk,&phylen,NULL,NULL);
-                if (sts & 1) {
-                    if (phylen > length) phylen = length;
-                    if (fcb->highwater != 0 && curvbn + phylen > fcb->highwater) {
-                        phylen = fcb->highwater - curvbn;
-                    }
-                    sts = phyio_read(vcbdev->dev->handle,phyblk,phylen * 512,address);
-                }
-                if ((sts & 1) == 0) {
-                    free(vioc);
-                    *retsts = sts;
-                    return NULL;
-                }
-                length -= phylen;
-                curvbn += phylen;
-                address += phylen * 512;
-            }
-        } while (length > 0);
+        memset(vioc->wrtmask,0,sizeof(vioc->wrtmask));
+        memset(vioc->modmask,0,sizeof(vioc->modmask));
+        if ((fcb->status & FCB_PREFETCH) &&
+            fcb->prefetch < curvbn + length + PREFETCH_BLOCKS / 2) {
+            access_prefetch(fcb,curvbn + length,PREFETCH_BLOCKS);
+        }
+        if (mapaddr != NULL) {
+            vioc->address = mapaddr;
+            vioc->state = VIOC_READY;
+        } else {
+            vioc->address = (char *) vioc->data;
+            if (fcb->vcb->status & VCB_DIRECT) vioc->address = ALIGNED(vioc->address);
+            vioc->state = VIOC_EMPTY;
+        }
         *retsts = SS$_NORMAL;
     }
     return vioc;
@@ -505,30 +1417,37 @@ unsigned accesschunk(struct FCB *fcb,unsigned vbn,struct VIOC **retvioc,
     printf("Access chunk %8x %d (%x)\n",base,vbn,fcb->cache.hashval);
 #endif
     if (vbn < 1 || vbn > fcb->hiblock) return SS$_ENDOFFILE;
-    blocks = (vbn - 1) / VIOC_CHUNKSIZE * VIOC_CHUNKSIZE;
+    blocks = (vbn - 1) / fcb->chunksize * fcb->chunksize;
     if (wrtblks) {
         if ((fcb->status & FCB_WRITE) == 0) return SS$_WRITLCK;
-        if (vbn + wrtblks > blocks + VIOC_CHUNKSIZE + 1) {
+        if (vbn + wrtblks > blocks + fcb->chunksize + 1) {
 	     return SS$_BADPARAM;
         }
     }
     vioc = cache_find((void *) &fcb->vioc,blocks,fcb,&sts,NULL,vioc_create);
     if (vioc == NULL) return sts;
+    sts = vioc_load(vioc);
+    if ((sts & 1) == 0) {
+        cache_untouch(&vioc->cache,0);
+        return sts;
+    }
     /*
         Return result to caller...
     */
     *retvioc = vioc;
     blocks = vbn - blocks - 1;
-    *retbuff = vioc->data[blocks];
+    *retbuff = vioc->address + blocks * 512;
     if (wrtblks || retblocks != NULL) {
-        register unsigned modmask = 1 << blocks;
-        blocks = VIOC_CHUNKSIZE - blocks;
+        register unsigned first = blocks;
+        blocks = fcb->chunksize - blocks;
         if (vbn + blocks > fcb->hiblock) blocks = fcb->hiblock - vbn + 1;
         if (wrtblks && blocks > wrtblks) blocks = wrtblks;
         if (retblocks != NULL) *retblocks = blocks;
         if (wrtblks && blocks) {
-            while (--blocks > 0) modmask |= modmask << 1;
-            vioc->wrtmask |= modmask;
+            while (blocks-- > 0) {
+                VIOC_SETBIT(vioc->wrtmask,first);
+                first++;
+            }
             vioc->cache.objmanager = vioc_manager;
         }
     }
@@ -545,10 +1464,12 @@ unsigned deaccessfile(struct FCB *fcb)
 #ifdef DEBUG
     printf("Deaccessing file (%x) reference %d\n",fcb->cache.hashval,fcb->cache.refcount);
 #endif
+    cache_lock();               /* Last reference tidies the FCB up */
     if (fcb->cache.refcount == 1) {
         register unsigned refcount;
         refcount = cache_refcount((struct CACHE *) fcb->wcb) +
-            cache_refcount((struct CACHE *) fcb->vioc);
+            cache_refcount((struct CACHE *) fcb->vioc) +
+            cache_refcount((struct CACHE *) fcb->dirindex);
         if (refcount != 0) {
             printf("File reference counts non-zero %d  (%d)\n",refcount,
 		fcb->cache.hashval);
@@ -556,21 +1477,26 @@ unsigned deaccessfile(struct FCB *fcb)
             printf("File reference counts non-zero %d %d\n",
                    cache_refcount((struct CACHE *) fcb->wcb),cache_refcount((struct CACHE *) fcb->vioc));
 #endif
+            cache_unlock();
             return SS$_BUGCHECK;
         }
+        vioc_endreadahead(fcb);
         if (fcb->status & FCB_WRITE) {
             if (VMSLONG(fcb->head->fh2$l_filechar) & FH2$M_MARKDEL) {
-                return deallocfile(fcb);
+                register unsigned sts = deallocfile(fcb);
+                cache_unlock();
+                return sts;
             }
         }
     }
     cache_untouch(&fcb->cache,1);
+    cache_unlock();
     return SS$_NORMAL;
 }
 
 
 /* Object manager for FCB objects:- we point to one of our
-   sub-objects (vioc or wcb) in preference to letting the
+   sub-objects (vioc, wcb or dirindex) in preference to letting the
    cache routines get us!  But we when run out of excuses
    it is time to clean up the file header...  :-(   */
 
@@ -579,7 +1505,9 @@ void *fcb_manager(struct CACHE *cacheobj,int flushonly)
     register struct FCB *fcb = (struct FCB *) cacheobj;
     if (fcb->vioc != NULL) return &fcb->vioc->cache;
     if (fcb->wcb != NULL) return &fcb->wcb->cache;
+    if (fcb->dirindex != NULL) return (struct CACHE *) fcb->dirindex;
     if (fcb->cache.refcount != 0 || flushonly) return NULL;
+    vioc_endreadahead(fcb);
     if (fcb->headvioc != NULL) {
         deaccesshead(fcb->headvioc,fcb->head,fcb->headvbn);
         fcb->headvioc = NULL;
@@ -589,20 +1517,28 @@ void *fcb_manager(struct CACHE *cacheobj,int flushonly)
 
 void *fcb_create(unsigned filenum,void *keyval,unsigned *retsts)
 {
-    register struct FCB *fcb = (struct FCB *) malloc(sizeof(struct FCB));
+    register struct VCB *vcb = (struct VCB *) keyval;
+    register struct FCB *fcb = (struct FCB *) cache_alloc(vcb->arena,2,sizeof(struct FCB));
     if (fcb == NULL) {
         *retsts = SS$_INSFMEM;
     } else {
         fcb->cache.objmanager = fcb_manager;
-        fcb->cache.objtype = 2;
         fcb->vcb = NULL;
         fcb->headvioc = NULL;
         fcb->head = NULL;
         fcb->wcb = NULL;
         fcb->vioc = NULL;
+        fcb->dirindex = NULL;
         fcb->headvbn = 0;
         fcb->hiblock = 100000;
         fcb->highwater = 0;
+        fcb->prefetch = 0;
+        fcb->rabuffer = NULL;
+        fcb->ravbn = 0;
+        fcb->rablocks = 0;
+        fcb->ranext = 0;
+        fcb->rawindow = VIOC_CHUNKSIZE;
+        fcb->chunksize = VIOC_CHUNKSIZE;
         fcb->status = 0;
         fcb->rvn = 0;
     }
@@ -625,10 +1561,11 @@ unsigned accessfile(struct VCB * vcb,struct fiddef * fid,struct FCB **fcbadd,
     if (filenum < 1) return SS$_BADPARAM;
     if (wrtflg && ((vcb->status & VCB_WRITE) == 0)) return SS$_WRITLCK;
     if (fid->fid$b_rvn > 1) filenum |= fid->fid$b_rvn << 24;
-    fcb = cache_find((void *) &vcb->fcb,filenum,NULL,&sts,NULL,fcb_create);
+    fcb = cache_find((void *) &vcb->fcb,filenum,vcb,&sts,NULL,fcb_create);
     if (fcb == NULL) return sts;
-    /* If not found make one... */
+    /* If not found make one... (another context may be opening it too) */
     *fcbadd = fcb;
+    cache_lock();
     if (fcb->vcb == NULL) {
         fcb->rvn = fid->fid$b_rvn;
         if (fcb->rvn == 0 && vcb->devices > 1) fcb->rvn = 1;
@@ -639,6 +1576,7 @@ unsigned accessfile(struct VCB * vcb,struct fiddef * fid,struct FCB **fcbadd,
             deaccesshead(fcb->headvioc,NULL,0);
             fcb->headvioc = NULL;
         }
+        vioc_endreadahead(fcb);
         fcb->status |= FCB_WRITE;
     }
     if (fcb->headvioc == NULL) {
@@ -651,14 +1589,29 @@ unsigned accessfile(struct VCB * vcb,struct fiddef * fid,struct FCB **fcbadd,
             } else {
                 fcb->highwater = 0;
             }
+            if ((fid->fid$w_num <= 2 && fid->fid$b_nmx == 0) ||
+                (VMSLONG(fcb->head->fh2$l_filechar) & FH2$M_DIRECTORY)) {
+                fcb->status |= FCB_METADATA;
+            }
+            if (fcb->vioc == NULL) {
+                if ((fid->fid$w_num == 1 && fid->fid$b_nmx == 0) ||
+                    (VMSLONG(fcb->head->fh2$l_filechar) & FH2$M_DIRECTORY)) {
+                    fcb->chunksize = VIOC_CHUNKSIZE;
+                } else {
+                    fcb->chunksize = vcb->chunksize;
+                }
+                fcb->rawindow = fcb->chunksize;
+            }
         } else {
             printf("Accessfile status %d\n",sts);
             fcb->cache.objmanager = NULL;
             cache_untouch(&fcb->cache,0);
             cache_delete(&fcb->cache);
+            cache_unlock();
             return sts;
         }
     }
+    cache_unlock();
     return SS$_NORMAL;
 }
 
@@ -681,6 +1634,7 @@ unsigned dismount(struct VCB * vcb)
     if (openfiles != expectfiles) {
         sts = SS$_DEVNOTDISM;
     } else {
+        if (vcb->status & VCB_WRITE) access_flush();
         vcbdev = vcb->vcbdev;
         for (device = 0; device < vcb->devices; device++) {
             if (vcbdev->dev != NULL) {
@@ -689,12 +1643,16 @@ unsigned dismount(struct VCB * vcb)
                     if (!(sts & 1)) break;
                     vcbdev->idxfcb->status &= ~FCB_WRITE;
                     vcbdev->mapfcb = NULL;
+                    if (vcbdev->mapsum != NULL) free(vcbdev->mapsum);
+                    vcbdev->mapsum = NULL;
                 }
                 cache_remove(&vcb->fcb->cache);
                 sts = deaccesshead(vcbdev->idxfcb->headvioc,vcbdev->idxfcb->head,vcbdev->idxfcb->headvbn);
                 if (!(sts & 1)) break;
                 vcbdev->idxfcb->headvioc = NULL;
                 cache_untouch(&vcbdev->idxfcb->cache,0);
+                phyio_unmap(vcbdev->dev->handle);
+                if (vcb->status & VCB_DIRECT) phyio_direct(vcbdev->dev->handle,0);
                 vcbdev->dev->vcb = NULL;
             }
             vcbdev++;
@@ -702,10 +1660,19 @@ unsigned dismount(struct VCB * vcb)
         if (sts & 1) {
             cache_remove(&vcb->fcb->cache);
             while (vcb->dircache) cache_delete((struct CACHE *) vcb->dircache);
+            for (device = 0; device < vcb->devices; device++) {
+                vcbdev = &vcb->vcbdev[device];
+                if (vcbdev->journal != NULL) journal_close(vcbdev->journal);
+                if ((vcb->status & VCB_OVERLAY) && vcbdev->dev != NULL) {
+                    phyio_overlay(vcbdev->dev->handle,vcbdev->dev->devnam,OVERLAY_CLOSE);
+                }
+                if (vcbdev->dev != NULL) device_release(vcbdev->dev);
+            }
 #ifdef DEBUG
             printf("Post close\n");
             cachedump();
 #endif
+            cache_arenafree(vcb->arena);
             free(vcb);
         }
     }
@@ -716,7 +1683,8 @@ unsigned dismount(struct VCB * vcb)
 
 /* mount() make disk volume available for processing... */
 
-unsigned mount(unsigned flags,unsigned devices,char *devnam[],char *label[],struct VCB **retvcb)
+unsigned mount(unsigned flags,unsigned chunksize,unsigned devices,
+               char *devnam[],char *label[],struct VCB **retvcb)
 {
     register unsigned device,sts;
     struct VCB *vcb;
@@ -725,9 +1693,20 @@ unsigned mount(unsigned flags,unsigned devices,char *devnam[],char *label[],stru
     vcb = (struct VCB *) malloc(sizeof(struct VCB) + (devices - 1) * sizeof(struct VCBDEV));
     if (vcb == NULL) return SS$_INSFMEM;
     vcb->status = 0;
-    if (flags & 1) vcb->status |= VCB_WRITE;
+    if (flags & MOU_WRITE) {
+        vcb->status |= VCB_WRITE;
+    } else {
+        if (flags & MOU_MAP) vcb->status |= VCB_MAPPED;
+    }
+    if (flags & MOU_DIRECT) vcb->status |= VCB_DIRECT;
+    if (flags & MOU_OVERLAY) vcb->status |= VCB_OVERLAY;
     vcb->fcb = NULL;
     vcb->dircache = NULL;
+    vcb->dircount = 0;
+    vcb->arena = cache_arena(flags & MOU_PARTITION);
+    if (chunksize < 1) chunksize = VIOC_CHUNKSIZE;
+    if (chunksize > VIOC_CHUNKMAX) chunksize = VIOC_CHUNKMAX;
+    vcb->chunksize = chunksize;
     vcbdev = vcb->vcbdev;
     for (device = 0; device < devices; device++) {
         sts = SS$_NOSUCHVOL;
@@ -736,6 +1715,24 @@ unsigned mount(unsigned flags,unsigned devices,char *devnam[],char *label[],stru
             int hba;
             sts = device_lookup(strlen(devnam[device]),devnam[device],1,&vcbdev->dev);
             if (!(sts & 1)) break;
+            sts = device_claim(vcbdev->dev,vcb);
+            if (!(sts & 1)) {
+                vcbdev->dev = NULL;
+                break;
+            }
+            if (vcb->status & VCB_OVERLAY) {
+                sts = phyio_overlay(vcbdev->dev->handle,vcbdev->dev->devnam,OVERLAY_OPEN);
+                if (!(sts & 1)) break;
+            }
+            if (vcb->status & VCB_WRITE) {
+                sts = journal_replay(vcbdev->dev);
+                if (!(sts & 1)) break;
+            }
+            if (vcb->status & VCB_DIRECT) {
+                if ((phyio_direct(vcbdev->dev->handle,1) & 1) == 0) {
+                    printf("%%MOUNT-I-NODIRECT, %s using buffered I/O\n",vcbdev->dev->devnam);
+                }
+            }
             for (hba = 1; hba <= HOME_LIMIT; hba++) {
                 sts = phyio_read(vcbdev->dev->handle,hba,sizeof(struct HOME),(char *) &vcbdev->home);
                 if (!(sts & 1)) break;
@@ -750,8 +1747,10 @@ unsigned mount(unsigned flags,unsigned devices,char *devnam[],char *label[],stru
                     if (VMSWORD(vcbdev->home.hm2$w_rvn) != device + 1)
                         if (VMSWORD(vcbdev->home.hm2$w_rvn) > 1 || device != 0)
                             sts = SS$_UNSUPVOLSET;
-                    if (vcbdev->dev->vcb != NULL) {
-                        sts = SS$_DEVMOUNT;
+                    if (vcb->status & VCB_MAPPED) {
+                        if ((phyio_map(vcbdev->dev->handle) & 1) == 0) {
+                            printf("%%MOUNT-I-NOMAP, %s not mapped\n",vcbdev->dev->devnam);
+                        }
                     }
                 }
             }
@@ -768,14 +1767,26 @@ unsigned mount(unsigned flags,unsigned devices,char *devnam[],char *label[],stru
             vcbdev->clustersize = 0;
             vcbdev->max_cluster = 0;
             vcbdev->free_clusters = 0;
+            vcbdev->mapsum = NULL;
+            vcbdev->mapblocks = 0;
+            vcbdev->headnext = 0;
+            vcbdev->headcount = 0;
+            vcbdev->journal = NULL;
             if (strlen(devnam[device])) {
                 struct fiddef idxfid = {1,1,0,0};
                 idxfid.fid$b_rvn = device + 1;
                 sts = accessfile(vcb,&idxfid,&vcbdev->idxfcb,flags & 1);
                 if (!(sts & 1)) {
+                    device_release(vcbdev->dev);
                     vcbdev->dev = NULL;
                 } else {
                     vcbdev->dev->vcb = vcb;
+                    if ((flags & 1) && (flags & MOU_JOURNAL)) {
+                        vcbdev->journal = journal_open(vcbdev->dev);
+                        if (vcbdev->journal == NULL) {
+                            printf("%%MOUNT-I-NOJOURNAL, %s not journalled\n",vcbdev->dev->devnam);
+                        }
+                    }
                     if (flags & 1) {
                         struct fiddef mapfid = {2,2,0,0};
                         mapfid.fid$b_rvn = device + 1;
@@ -788,9 +1799,8 @@ unsigned mount(unsigned flags,unsigned devices,char *devnam[],char *label[],stru
                                 if (scb->scb$w_cluster == vcbdev->home.hm2$w_cluster) {
                                     vcbdev->clustersize = vcbdev->home.hm2$w_cluster;
                                     vcbdev->max_cluster = (scb->scb$l_volsize + scb->scb$w_cluster - 1) / scb->scb$w_cluster;
+                                    vcbdev->free_clusters = FREE_UNKNOWN;
                                     deaccesschunk(vioc,0,0,0);
-				    sts = update_freecount(vcbdev,&vcbdev->free_clusters);
-printf("Freespace is %d\n",vcbdev->free_clusters);
                                 }
                             }
                         }
@@ -800,9 +1810,105 @@ printf("Freespace is %d\n",vcbdev->free_clusters);
             vcbdev++;
         }
     } else {
+        vcbdev = vcb->vcbdev;
+        while (vcbdev <= &vcb->vcbdev[device] && vcbdev < &vcb->vcbdev[devices]) {
+            if (vcbdev->dev != NULL) {
+                if (vcb->status & (VCB_MAPPED | VCB_DIRECT | VCB_OVERLAY)) {
+                    phyio_unmap(vcbdev->dev->handle);
+                    phyio_direct(vcbdev->dev->handle,0);
+                    phyio_overlay(vcbdev->dev->handle,vcbdev->dev->devnam,OVERLAY_CLOSE);
+                }
+                device_release(vcbdev->dev);
+            }
+            vcbdev++;
+        }
+        cache_arenafree(vcb->arena);
         free(vcb);
         vcb = NULL;
     }
     if (retvcb != NULL) *retvcb = vcb;
     return sts;
 }
+
+
+/* access_scanindex() reads INDEXF.SYS of one volume in large transfers
+   straight from the device, rather than a chunk at a time through the
+   cache, and checks every header as it goes: its offsets and checksum,
+   and that its FID matches its place in the file. A table of the headers
+   in use is returned (to be freed by the caller) along with a count of
+   any which fail the checks. Free headers (no FID or checksum) are
+   skipped... */
+
+unsigned access_scanindex(struct VCB *vcb,unsigned rvn,struct HEADINFO **rettable,
+                          unsigned *retcount,unsigned *retbad)
+{
+    register unsigned sts = SS$_NORMAL;
+    register struct VCBDEV *vcbdev = rvn_to_dev(vcb,rvn);
+    register struct FCB *fcb;
+    struct HEADINFO *table = NULL;
+    unsigned count = 0,tablemax = 0,bad = 0;
+    unsigned firstblk,eofblk,vbn;
+    char *buffer,*aligned;
+    unsigned char valid[SCAN_BLOCKS];
+    if (vcbdev == NULL) return SS$_DEVNOTMOUNT;
+    fcb = vcbdev->idxfcb;
+    if (fcb == NULL || fcb->head == NULL) return SS$_NOSUCHFILE;
+    if (vcb->status & VCB_WRITE) access_flush();
+    firstblk = VMSWORD(vcbdev->home.hm2$w_ibmapvbn) + VMSWORD(vcbdev->home.hm2$w_ibmapsize);
+    eofblk = VMSSWAP(fcb->head->fh2$w_recattr.fat$l_efblk);
+    buffer = (char *) malloc(SCAN_BLOCKS * 512 + PHYIO_ALIGN);
+    if (buffer == NULL) return SS$_INSFMEM;
+    aligned = ALIGNED(buffer);
+    for (vbn = firstblk; vbn < eofblk; ) {
+        struct VCBDEV *mapdev;
+        unsigned phyblk,phylen,blk;
+        sts = getwindow(fcb,vbn,&mapdev,&phyblk,&phylen,NULL,NULL);
+        if ((sts & 1) == 0) break;
+        if (phylen > SCAN_BLOCKS) phylen = SCAN_BLOCKS;
+        if (phylen > eofblk - vbn) phylen = eofblk - vbn;
+        sts = phyio_read(mapdev->dev->handle,phyblk,phylen * 512,aligned);
+        if ((sts & 1) == 0) break;
+        checksum_many((vmsword *) aligned,phylen,valid);
+        for (blk = 0; blk < phylen; blk++) {
+            register struct HEAD *head = (struct HEAD *) (aligned + blk * 512);
+            register unsigned filenum = vbn + blk - firstblk + 1;
+            register struct HEADINFO *info;
+            if (head->fh2$w_checksum == 0 ||
+                (head->fh2$w_fid.fid$w_num == 0 && head->fh2$w_fid.fid$b_nmx == 0)) continue;
+            if (!valid[blk] || !head_offsets(head) ||
+                VMSWORD(head->fh2$w_fid.fid$w_num) + (head->fh2$w_fid.fid$b_nmx << 16) != filenum) {
+                bad++;
+                continue;
+            }
+            if (count >= tablemax) {
+                register struct HEADINFO *newtable;
+                tablemax = tablemax ? tablemax * 2 : 256;
+                newtable = (struct HEADINFO *) realloc(table,tablemax * sizeof(struct HEADINFO));
+                if (newtable == NULL) {
+                    sts = SS$_INSFMEM;
+                    break;
+                }
+                table = newtable;
+            }
+            info = &table[count++];
+            fid_copy(&info->fid,&head->fh2$w_fid,rvn);
+            fid_copy(&info->ext_fid,&head->fh2$w_ext_fid,rvn);
+            fid_copy(&info->backlink,&head->fh2$w_backlink,rvn);
+            info->seg_num = VMSWORD(head->fh2$w_seg_num);
+            info->filechar = VMSLONG(head->fh2$l_filechar);
+            info->hiblk = VMSSWAP(head->fh2$w_recattr.fat$l_hiblk);
+            info->idxblk = vbn + blk;
+        }
+        if ((sts & 1) == 0) break;
+        vbn += phylen;
+    }
+    free(buffer);
+    if (sts & 1) {
+        *rettable = table;
+        *retcount = count;
+        *retbad = bad;
+    } else {
+        if (table != NULL) free(table);
+    }
+    return sts;
+}
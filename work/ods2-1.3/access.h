@@ -11,10 +11,26 @@
 */
 
 #define NO_DOLLAR
+#include <stddef.h>
 #include "cache.h"
 #include "vmstime.h"
 
+/* HOST_BIG_ENDIAN is set when this machine keeps the high byte first.
+   The compiler's predefined byte order is used where it has one: glibc
+   defines BIG_ENDIAN whatever the byte order, so that is only trusted
+   on compilers which don't */
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN
+#endif
+#else
 #ifdef BIG_ENDIAN
+#define HOST_BIG_ENDIAN
+#endif
+#endif
+
+#ifdef HOST_BIG_ENDIAN
 #define VMSLONG(l) ((l & 0xff) << 24 | (l & 0xff00) << 8 | (l & 0xff0000) >> 8 | l >> 24)
 #define VMSWORD(w) ((w & 0xff) << 8 | w >> 8)
 #define VMSSWAP(l) ((l & 0xff0000) << 8 | (l & 0xff000000) >> 8 |(l & 0xff) << 8 | (l & 0xff00) >> 8)
@@ -176,33 +192,53 @@ struct SCB {
 #pragma member_alignment restore
 #endif
 
-#define EXTMAX 20
+struct EXTENT {
+    unsigned vbn;               /* First vbn of extent */
+    unsigned phyblk;            /* First lbn of extent */
+    unsigned phylen;            /* Blocks in extent */
+    unsigned short hd_seg_num;  /* Header segment which maps it */
+    unsigned char rvn;          /* Relative volume of extent */
+};                              /* One extent of a file */
 
 struct WCB {
     struct CACHE cache;
-    unsigned loblk,hiblk;       /* Range of window */
-    unsigned hd_basevbn;        /* File blocks prior to header */
-    unsigned hd_seg_num;        /* Header segment number */
-    struct fiddef hd_fid;       /* Header FID */
-    unsigned short extcount;    /* Extents in use */
-    unsigned phylen[EXTMAX];
-    unsigned phyblk[EXTMAX];
-    unsigned char rvn[EXTMAX];
-};                              /* Window control block */
+    unsigned hiblk;             /* Highest vbn mapped */
+    unsigned extcount;          /* Extents in map */
+    unsigned segcount;          /* Header segments */
+    struct fiddef *hd_fid;      /* Header FID of each segment */
+    struct EXTENT extent[1];    /* Extents in vbn order */
+};                              /* Window control block (whole file map) */
+
 
+#define VIOC_CHUNKSIZE 4        /* Default chunk (always for INDEXF/directories) */
+#define VIOC_CHUNKMAX 128       /* Largest chunk size */
+#define VIOC_MASKS (VIOC_CHUNKMAX / 32)
 
-#define VIOC_CHUNKSIZE 4
+#define VIOC_BIT(mask,block) ((mask)[(block) / 32] & ((unsigned) 1 << ((block) % 32)))
+#define VIOC_SETBIT(mask,block) ((mask)[(block) / 32] |= (unsigned) 1 << ((block) % 32))
+
+#define VIOC_EMPTY 0            /* VIOC data not read yet... */
+#define VIOC_LOADING 1          /* being read (see vioc_load()) */
+#define VIOC_READY 2            /* read */
 
 struct VIOC {
     struct CACHE cache;
     struct FCB *fcb;            /* File this chunk is for */
-    unsigned wrtmask;           /* Bit mask for writable blocks */
-    unsigned modmask;           /* Bit mask for modified blocks */
-    char data[VIOC_CHUNKSIZE][512];     /* Chunk data */
+    unsigned char state;        /* VIOC_EMPTY, VIOC_LOADING or VIOC_READY */
+    unsigned wrtmask[VIOC_MASKS];       /* Bit mask for writable blocks */
+    unsigned modmask[VIOC_MASKS];       /* Bit mask for modified blocks */
+    char *address;              /* Chunk data (data[] or device mapping) */
+    char data[1][512];          /* Chunk data (fcb->chunksize blocks) */
 };                              /* Chunk of a file */
 
+#define VIOC_MAPSIZE offsetof(struct VIOC,data)
+
 
 #define FCB_WRITE 1             /* FCB open for write... */
+#define FCB_PREFETCH 2          /* FCB being read sequentially */
+#define FCB_METADATA 4          /* FCB of a directory or volume file */
+
+struct DIRINDEX;
 
 struct FCB {
     struct CACHE cache;
@@ -211,9 +247,17 @@ struct FCB {
     struct HEAD *head;          /* Pointer to header block */
     struct WCB *wcb;            /* Window control block tree */
     struct VIOC *vioc;          /* Virtual I/O chunk tree */
+    struct DIRINDEX *dirindex;  /* Directory name index (or NULL) */
     unsigned headvbn;           /* vbn for file header */
     unsigned hiblock;           /* Highest block mapped */
     unsigned highwater;         /* First high water block */
+    unsigned prefetch;          /* Read ahead requested up to this vbn */
+    char *rabuffer;             /* Read ahead buffer (or NULL) */
+    unsigned ravbn;             /* First vbn in read ahead buffer */
+    unsigned rablocks;          /* Blocks in read ahead buffer */
+    unsigned ranext;            /* Next vbn if reading sequentially */
+    unsigned rawindow;          /* Current read ahead window */
+    unsigned chunksize;         /* Blocks in each VIOC of this file */
     unsigned char status;       /* FCB status bits */
     unsigned char rvn;          /* Initial file relative volume */
 };                              /* File control block */
@@ -221,6 +265,7 @@ struct FCB {
 
 struct DIRCACHE {
     struct CACHE cache;
+    struct VCB *vcb;            /* Volume this directory is on */
     int dirlen;                 /* Length of directory name */
     struct fiddef dirid;        /* File ID of directory */
     char dirnam[1];             /* Directory name */
@@ -228,12 +273,31 @@ struct DIRCACHE {
 
 
 #define VCB_WRITE 1
+#define VCB_MAPPED 2            /* Volume devices are memory mapped */
+#define VCB_DIRECT 4            /* Volume devices bypass system cache */
+#define VCB_OVERLAY 8           /* Volume writes go to overlay deltas */
+
+#define FREE_UNKNOWN 0xffffffff /* Free clusters not counted yet */
+#define HEAD_BATCH 16           /* Free headers found per index bitmap scan */
+
+#define MOU_WRITE 1             /* Mount flags... */
+#define MOU_MAP 2
+#define MOU_DIRECT 4
+#define MOU_PARTITION 8         /* Cache partition per object type */
+#define MOU_JOURNAL 16          /* Journal metadata writes */
+#define MOU_OVERLAY 32          /* Write to delta files, not devices */
+
+struct MAPSUM;
+struct JOURNAL;
 
 struct VCB {
     unsigned status;            /* Volume status */
     unsigned devices;           /* Number of volumes in set */
     struct FCB *fcb;            /* File control block tree */
     struct DIRCACHE *dircache;  /* Directory cache tree */
+    unsigned dircount;          /* Entries in directory cache */
+    unsigned chunksize;         /* VIOC chunk size for data files */
+    struct ARENA *arena;        /* Allocation arena for volume objects */
     struct VCBDEV {
         struct DEV *dev;        /* Pointer to device info */
         struct FCB *idxfcb;     /* Index file control block */
@@ -241,6 +305,12 @@ struct VCB {
         unsigned clustersize;   /* Cluster size of the device */
         unsigned max_cluster;   /* Total clusters on the device */
 	unsigned free_clusters;	/* Free clusters on disk volume */
+        struct MAPSUM *mapsum;  /* Summary of cluster bitmap (or NULL) */
+        unsigned mapblocks;     /* Blocks summarised */
+        unsigned headnext;      /* Where next index bitmap scan starts */
+        unsigned headcount;     /* Free headers held in headfree[] */
+        unsigned headfree[HEAD_BATCH];  /* Checked free headers (lowest last) */
+        struct JOURNAL *journal;        /* Metadata journal (or NULL) */
         struct HOME home;       /* Volume home block */
     } vcbdev[1];                /* List of volumes devices */
 };                              /* Volume control block */
@@ -249,6 +319,7 @@ struct VCB {
 struct DEV {
     struct CACHE cache;
     struct VCB *vcb;            /* Pointer to volume (if mounted) */
+    struct VCB *claim;          /* Volume mounting or mounted on it */
     unsigned handle;            /* Device physical I/O handle */
     unsigned status;            /* Device physical status */
     unsigned sectors;           /* Device physical sectors */
@@ -256,11 +327,41 @@ struct DEV {
     char devnam[1];             /* Device name */
 };                              /* Device information */
 
+#define IFI_MAX 64               /* Files open in one context */
+#define DEFAULT_SIZE 120
+
+struct WCCFILE;
+
+struct CONTEXT {
+    struct WCCFILE *ifi_table[IFI_MAX]; /* Open files by FAB ifi */
+    char *default_name;         /* Default device and directory */
+    int default_size[5];        /* Size of each default field */
+    char default_buffer[DEFAULT_SIZE];
+};                              /* Library context */
+
+struct CONTEXT *ctx_current(void);
+struct CONTEXT *ctx_set(struct CONTEXT *ctx);
+struct CONTEXT *ctx_create(void);
+unsigned ctx_delete(struct CONTEXT *ctx);
+
+struct HEADINFO {
+    struct fiddef fid;          /* File ID of header */
+    struct fiddef ext_fid;      /* Extension header (if any) */
+    struct fiddef backlink;     /* Directory back link */
+    unsigned short seg_num;     /* Header segment number */
+    unsigned filechar;          /* File characteristics */
+    unsigned hiblk;             /* Blocks allocated */
+    unsigned idxblk;            /* Header vbn in INDEXF.SYS */
+};                              /* Header found by access_scanindex() */
+
 void fid_copy(struct fiddef *dst,struct fiddef *src,unsigned rvn);
 unsigned device_lookup(unsigned devlen,char *devnam,int create,struct DEV **retdev);
+unsigned device_claim(struct DEV *dev,struct VCB *vcb);
+void device_release(struct DEV *dev);
 
 unsigned dismount(struct VCB *vcb);
-unsigned mount(unsigned flags,unsigned devices,char *devnam[],char *label[],struct VCB **vcb);
+unsigned mount(unsigned flags,unsigned chunksize,unsigned devices,
+               char *devnam[],char *label[],struct VCB **vcb);
 
 unsigned accesserase(struct VCB *vcb,struct fiddef *fid);
 unsigned deaccessfile(struct FCB *fcb);
@@ -271,8 +372,18 @@ unsigned deaccesschunk(struct VIOC *vioc,unsigned wrtvbn,int wrtblks,int reuse);
 unsigned accesschunk(struct FCB *fcb,unsigned vbn,struct VIOC **retvioc,
                      char **retbuff,unsigned *retblocks,unsigned wrtblks);
 unsigned access_extend(struct FCB *fcb,unsigned blocks,unsigned contig);
+void access_prefetch(struct FCB *fcb,unsigned vbn,unsigned blocks);
+unsigned access_flush(void);
+void access_begin(void);
+void access_end(void);
+void access_show(void);
 unsigned update_freecount(struct VCBDEV *vcbdev,unsigned *retcount);
+unsigned update_getfree(struct VCBDEV *vcbdev,unsigned *retfree);
 unsigned update_create(struct VCB *vcb,struct fiddef *did,char *filename,
                        struct fiddef *fid,struct FCB **fcb);
 unsigned update_extend(struct FCB *fcb,unsigned blocks,unsigned contig);
 unsigned short checksum(vmsword *block);
+unsigned checksum_many(vmsword *blocks,unsigned count,unsigned char *valid);
+unsigned head_check(struct HEAD *head);
+unsigned access_scanindex(struct VCB *vcb,unsigned rvn,struct HEADINFO **rettable,
+                          unsigned *retcount,unsigned *retbad);
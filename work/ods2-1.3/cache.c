@@ -42,6 +42,56 @@
     whether the object is likely to be referenced again so that the object
     can be put in the 'correct' end of this list.
 
+    To stop one large scan (COPY, SEARCH...) from flushing everything
+    else the free objects are kept in two lists after the fashion of 2Q.
+    Objects go on 'fifolist' when first released and stay there however
+    often they are reused. Those that are trimmed from it leave a ghost
+    of their key behind, and if one is created again while its ghost is
+    remembered it is marked hot and kept on 'lrulist' from then on. The
+    trim takes from 'fifolist' while it holds more than a quarter of the
+    budget, so streamed data is lost before metadata which is re-read.
+
+    The lists are trimmed by size rather than by number of objects: the
+    bytes allocated for each object are kept in objsize, and when
+    unreferenced objects hold more than the budget (see cache_budget())
+    the oldest are deleted until they are back to half of it.
+
+    Each arena (volume) has its own partition with its own pair of lists
+    and budget - or one partition per object type if asked for - so that
+    scanning one volume only trims that volume's objects. A partition's
+    budget is set with cache_arenabudget(), otherwise it gets an equal
+    share of the overall budget.
+
+    Every object is also entered in a hash index keyed on its tree and
+    hash value, so that a lookup for an exact key (files, chunks, devices)
+    goes straight to a short chain rather than down the tree. Lookups with
+    a compare routine and a zero hash value are ordered searches - file
+    windows are found by which one covers a vbn - and these still walk the
+    tree, which is kept in window order. Should the index ever be short of
+    memory the objects it could not take are counted, and while there are
+    any a lookup that misses the index goes on to search the tree.
+
+    Objects are allocated with cache_alloc() from pools of one size each,
+    which are carved out of SLABSIZE slabs and keep a free list of deleted
+    objects for reuse. Pools belong to an arena: a volume has its own so
+    that when it is dismounted all of its slabs go back in one go. Objects
+    too big for a slab are simply malloc()ed, as is everything when built
+    with NO_POOL (handy for malloc debugging tools).
+
+    When built with CACHE_THREADS every entry point holds a recursive
+    lock, so that several threads may share the cache. The lock has to be
+    recursive because object managers and creation routines call back in.
+    It is one lock for the whole cache, not one per partition: threads
+    are kept out of each other's way but get no more cache throughput
+    than one. Locking partitions separately would need a lock order for
+    an FCB reaching into its WCB and VIOC trees (and the shared hash
+    index), which the access layer does not keep today. The access layer
+    takes the same lock through cache_lock() for its write behind queue,
+    device claims and volume updates, so that there is no second lock
+    to order. What the lock must not cover is the device: chunks of file
+    data are created empty and read after it is dropped (see vioc_load()
+    in access.c), so one thread's reads don't stall the rest.
+
     Note: These routines are 'general' in that do not know anything
     about ODS2 objects or structures....
 */
@@ -50,14 +100,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <stdint.h>
 #include "ssdef.h"
 #include "cache.h"
 
+#ifdef CACHE_THREADS
+#include <pthread.h>
+#include <time.h>
+
+pthread_mutex_t cachelock;
+pthread_cond_t cachewake = PTHREAD_COND_INITIALIZER;
+pthread_once_t cacheonce = PTHREAD_ONCE_INIT;
+
+void cache_lockinit(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&cachelock,&attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+#define CACHE_LOCK() (pthread_once(&cacheonce,cache_lockinit),pthread_mutex_lock(&cachelock))
+#define CACHE_UNLOCK() pthread_mutex_unlock(&cachelock)
+#else
+#define CACHE_LOCK()
+#define CACHE_UNLOCK()
+#endif
+
 
 #define DEBUG                   /* Debug mode? */
 #define IMBALANCE 5             /* Tree imbalance limit */
-#define CACHELIM  256           /* Free object limit */
-#define CACHEGOAL 128           /* Free object goal */
+#define CACHEBUDGET 4194304     /* Default bytes in free objects */
+#define CACHETYPES 16           /* Object types tracked by cache_show() */
+#define HASHINIT 256            /* Initial hash index size (power of 2) */
+#define GHOSTMAX 4096           /* Ghosts remembered (power of 2) */
+#define SLABSIZE 65536          /* Bytes carved into pool objects at once */
+#define SLABMAX 16384           /* Largest object allocated from a slab */
+#define SLABALIGN 16            /* Alignment of pool objects */
 
 int cachefinds = 0;
 int cachecreated = 0;
@@ -69,16 +149,467 @@ int cachedeletes = 0;
 
 int cachedeleteing = 0;         /* Cache deletion in progress... */
 
-struct CACHE lrulist = {&lrulist,&lrulist,NULL,NULL,NULL,NULL,0,0,1,0};
+unsigned long cachebudget = CACHEBUDGET;
+unsigned long cachefreebytes = 0;
+unsigned long cachetypebytes[CACHETYPES];
+int cachetypecount[CACHETYPES];
+
+#define CACHETYPE(obj) ((obj)->objtype & (CACHETYPES - 1))
+
+struct CACHE **hashtable = NULL;        /* Hash index of all objects */
+unsigned hashsize = 0;
+unsigned hashoutside = 0;       /* Objects missing from the hash index */
+int hashhits = 0;
+int hashprobes = 0;
+
+struct PARTITION {
+    struct PARTITION *next;     /* Next partition */
+    struct ARENA *arena;        /* Arena partition belongs to */
+    int objtype;                /* Object type held (-1 for all) */
+    struct CACHE lrulist;       /* Hot free objects */
+    struct CACHE fifolist;      /* Cold free objects */
+    int count;                  /* Objects in partition */
+    int freecount;              /* Free objects... */
+    unsigned long freebytes;
+    int fifocount;              /* Free objects on fifolist... */
+    unsigned long fifobytes;
+    int purges;
+};
+
+struct PARTITION *partitions = NULL;
+int cachepartitions = 0;
+
+void cache_trim(struct PARTITION *part);
+
+struct GHOST {
+    struct CACHE **root;        /* Tree of an object trimmed from fifolist */
+    unsigned hashval;           /* and its hash value */
+} ghosts[GHOSTMAX];
+int ghosthits = 0;
+int ghostcount = 0;
+
+struct POOL {
+    struct POOL *next;          /* Next pool of arena */
+    struct ARENA *arena;        /* Arena pool belongs to */
+    unsigned size;              /* Size of each object */
+    struct CACHE *freelist;     /* Deleted objects (linked by nextlru) */
+};
+
+struct ARENA {
+    struct POOL *pools;         /* Pools of this arena */
+    char *slabs;                /* Slabs (linked by first word) */
+    int inuse;                  /* Objects allocated and not freed */
+    int pertype;                /* Partition by object type? */
+    int nparts;                 /* Partitions in use */
+    unsigned long budget;       /* Bytes for partitions (0 for a fair share) */
+    struct PARTITION *parts[CACHETYPES];
+};
+
+struct ARENA globalarena = {NULL,NULL,0,0,0,0};
+int poolallocs = 0;
+int poolfrees = 0;
+int poolslabs = 0;
+int poolmallocs = 0;
+int arenasfreed = 0;
+
+
+/* cache_partbudget() - bytes the free objects of a partition may hold:
+   a share of its arena's budget if one was set, else of the overall one */
+
+unsigned long cache_partbudget(struct PARTITION *part)
+{
+    register struct ARENA *arena = part->arena;
+    if (arena->budget != 0) return arena->budget / arena->nparts;
+    return cachebudget / cachepartitions;
+}
+
+
+/* cache_partition() - find (or create) the partition of an arena which
+   holds objects of a given type... */
+
+struct PARTITION *cache_partition(struct ARENA *arena,int objtype)
+{
+    register int slot = arena->pertype ? objtype & (CACHETYPES - 1) : 0;
+    register struct PARTITION *part = arena->parts[slot];
+    if (part == NULL) {
+        part = (struct PARTITION *) malloc(sizeof(struct PARTITION));
+        if (part == NULL) return NULL;
+        part->arena = arena;
+        part->objtype = arena->pertype ? slot : -1;
+        part->lrulist.nextlru = part->lrulist.lastlru = &part->lrulist;
+        part->fifolist.nextlru = part->fifolist.lastlru = &part->fifolist;
+        part->count = 0;
+        part->freecount = 0;
+        part->freebytes = 0;
+        part->fifocount = 0;
+        part->fifobytes = 0;
+        part->purges = 0;
+        part->next = partitions;
+        partitions = part;
+        cachepartitions++;
+        arena->parts[slot] = part;
+        arena->nparts++;
+    }
+    return part;
+}
 
 
 /* cache_show() - to print cache statistics */
 
 void cache_show(void)
 {
+    CACHE_LOCK();
     printf("CACHE_SHOW Find %d Create %d Purge %d Peak %d Count %d Free %d\n",
            cachefinds,cachecreated,cachepurges,cachepeak,cachecount,cachefreecount);
     if (cachecreated - cachedeletes != cachecount) printf(" - Deleted %d\n",cachedeletes);
+    if (hashsize != 0) printf(" - Hash size %d Hits %d Probes %d\n",hashsize,hashhits,hashprobes);
+    printf(" - Budget %lu Free bytes %lu Partitions %d Ghosts %d Ghost hits %d\n",
+           cachebudget,cachefreebytes,cachepartitions,ghostcount,ghosthits);
+    {
+        register struct PARTITION *part;
+        register int partno = 0;
+        for (part = partitions; part != NULL; part = part->next) {
+            printf(" - Partition %d",partno++);
+            if (part->objtype >= 0) printf(" type %d",part->objtype);
+            printf(": Budget %lu Objects %d Cold %d (%lu bytes) Hot %d (%lu bytes) Purge %d\n",
+                   cache_partbudget(part),part->count,part->fifocount,part->fifobytes,
+                   part->freecount - part->fifocount,part->freebytes - part->fifobytes,
+                   part->purges);
+        }
+    }
+    printf(" - Pool allocs %d Frees %d Slabs %d Mallocs %d Arenas released %d\n",
+           poolallocs,poolfrees,poolslabs,poolmallocs,arenasfreed);
+    {
+        register int type;
+        for (type = 0; type < CACHETYPES; type++) {
+            if (cachetypecount[type] != 0) printf(" - Type %d: %d objects %lu bytes\n",
+                                                  type,cachetypecount[type],cachetypebytes[type]);
+        }
+    }
+    CACHE_UNLOCK();
+}
+
+
+/* cache_lock() and cache_unlock() let the caller hold the cache lock
+   over state of its own which changes along with cached objects... */
+
+void cache_lock(void)
+{
+    CACHE_LOCK();
+}
+
+void cache_unlock(void)
+{
+    CACHE_UNLOCK();
+}
+
+
+/* cache_wait() lets a thread holding the cache lock once give it up until
+   cache_wake() is called, or for at most the seconds given (0 for no
+   limit). Without CACHE_THREADS there is no one to wait for... */
+
+void cache_wait(unsigned seconds)
+{
+#ifdef CACHE_THREADS
+    if (seconds == 0) {
+        pthread_cond_wait(&cachewake,&cachelock);
+    } else {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME,&until);
+        until.tv_sec += seconds;
+        pthread_cond_timedwait(&cachewake,&cachelock,&until);
+    }
+#endif
+}
+
+void cache_wake(void)
+{
+#ifdef CACHE_THREADS
+    pthread_cond_broadcast(&cachewake);
+#endif
+}
+
+
+/* cache_budget() - set the bytes which unreferenced objects may hold... */
+
+void cache_budget(unsigned long bytes)
+{
+    CACHE_LOCK();
+    cachebudget = bytes;
+    cache_purge();
+    CACHE_UNLOCK();
+}
+
+
+/* cache_slaballoc() - allocate an object from a pool of the arena (or the
+   global arena if NULL), adding a slab to the pool if it has run dry.
+   The size, type, pool and partition are recorded in the object... */
+
+void *cache_slaballoc(struct ARENA *arena,int objtype,unsigned size)
+{
+    register struct CACHE *cacheobj;
+    register struct POOL *pool = NULL;
+    register struct PARTITION *part;
+    register unsigned objsize = (size + SLABALIGN - 1) / SLABALIGN * SLABALIGN;
+    if (arena == NULL) arena = &globalarena;
+    part = cache_partition(arena,objtype);
+    if (part == NULL) return NULL;
+#ifndef NO_POOL
+    if (objsize <= SLABMAX) {
+        for (pool = arena->pools; pool != NULL; pool = pool->next) {
+            if (pool->size == objsize) break;
+        }
+        if (pool == NULL) {
+            pool = (struct POOL *) malloc(sizeof(struct POOL));
+            if (pool != NULL) {
+                pool->arena = arena;
+                pool->size = objsize;
+                pool->freelist = NULL;
+                pool->next = arena->pools;
+                arena->pools = pool;
+            }
+        }
+    }
+#endif
+    if (pool == NULL) {
+        cacheobj = (struct CACHE *) malloc(size);
+        if (cacheobj == NULL) return NULL;
+        poolmallocs++;
+    } else {
+        if (pool->freelist == NULL) {
+            register char *slab = (char *) malloc(SLABSIZE);
+            register unsigned offset;
+            if (slab == NULL) return NULL;
+            *(char **) slab = arena->slabs;
+            arena->slabs = slab;
+            poolslabs++;
+            for (offset = SLABALIGN; offset + objsize <= SLABSIZE; offset += objsize) {
+                cacheobj = (struct CACHE *) (slab + offset);
+                cacheobj->nextlru = pool->freelist;
+                pool->freelist = cacheobj;
+            }
+        }
+        cacheobj = pool->freelist;
+        pool->freelist = cacheobj->nextlru;
+        arena->inuse++;
+        poolallocs++;
+    }
+    cacheobj->pool = pool;
+    cacheobj->partition = part;
+    cacheobj->objsize = size;
+    cacheobj->objtype = objtype;
+    part->count++;
+    return cacheobj;
+}
+
+
+/* cache_alloc() - allocate a cache object... */
+
+void *cache_alloc(struct ARENA *arena,int objtype,unsigned size)
+{
+    register void *obj;
+    CACHE_LOCK();
+    obj = cache_slaballoc(arena,objtype,size);
+    CACHE_UNLOCK();
+    return obj;
+}
+
+
+/* cache_free() - return an object to its pool... */
+
+void cache_free(struct CACHE *cacheobj)
+{
+    register struct POOL *pool = cacheobj->pool;
+    CACHE_LOCK();
+    cacheobj->partition->count--;
+    if (pool == NULL) {
+        free(cacheobj);
+    } else {
+        pool->arena->inuse--;
+        poolfrees++;
+        cacheobj->nextlru = pool->freelist;
+        pool->freelist = cacheobj;
+    }
+    CACHE_UNLOCK();
+}
+
+
+/* cache_arena() - create an arena for objects with a common lifetime.
+   Its objects are kept in a partition of their own, or in one for each
+   object type if pertype is set... */
+
+struct ARENA *cache_arena(int pertype)
+{
+    register struct ARENA *arena = (struct ARENA *) malloc(sizeof(struct ARENA));
+    if (arena != NULL) {
+        register int slot;
+        arena->pools = NULL;
+        arena->slabs = NULL;
+        arena->inuse = 0;
+        arena->pertype = pertype;
+        arena->nparts = 0;
+        arena->budget = 0;
+        for (slot = 0; slot < CACHETYPES; slot++) arena->parts[slot] = NULL;
+    }
+    return arena;
+}
+
+
+/* cache_arenabudget() - set the bytes the free objects of an arena may
+   hold (0 to give each of its partitions a share of the overall budget) */
+
+void cache_arenabudget(struct ARENA *arena,unsigned long bytes)
+{
+    register int slot;
+    CACHE_LOCK();
+    arena->budget = bytes;
+    for (slot = 0; slot < CACHETYPES; slot++) {
+        register struct PARTITION *part = arena->parts[slot];
+        if (part != NULL && part->freebytes > cache_partbudget(part)) cache_trim(part);
+    }
+    CACHE_UNLOCK();
+}
+
+
+/* cache_arenafree() - release an arena, its partitions and all of its
+   slabs at once. This can only be done when none of its objects remain,
+   so 0 is returned (and the arena kept) if any do */
+
+int cache_arenafree(struct ARENA *arena)
+{
+    register int slot;
+    if (arena == NULL) return 1;
+    CACHE_LOCK();
+    for (slot = 0; slot < CACHETYPES; slot++) {
+        if (arena->parts[slot] != NULL && arena->parts[slot]->count != 0) break;
+    }
+    if (arena->inuse != 0 || slot < CACHETYPES) {
+        CACHE_UNLOCK();
+        return 0;
+    }
+    for (slot = 0; slot < CACHETYPES; slot++) {
+        register struct PARTITION *part = arena->parts[slot];
+        if (part != NULL) {
+            register struct PARTITION **prev = &partitions;
+            while (*prev != part) prev = &(*prev)->next;
+            *prev = part->next;
+            cachepartitions--;
+            free(part);
+        }
+    }
+    while (arena->pools != NULL) {
+        register struct POOL *pool = arena->pools;
+        arena->pools = pool->next;
+        free(pool);
+    }
+    while (arena->slabs != NULL) {
+        register char *slab = arena->slabs;
+        arena->slabs = *(char **) slab;
+        free(slab);
+    }
+    free(arena);
+    arenasfreed++;
+    CACHE_UNLOCK();
+    return 1;
+}
+
+
+/* cache_hashkey() - hash of a tree and hash value... */
+
+unsigned cache_hashkey(struct CACHE **root,unsigned hashval)
+{
+    register uintptr_t key = (uintptr_t) root;
+    register unsigned hash = (unsigned) (key ^ (key >> 16)) * 2654435761u;
+    hash ^= hashval * 2246822519u;
+    return hash ^ (hash >> 15);
+}
+
+#define cache_hash(root,hashval) (cache_hashkey(root,hashval) & (hashsize - 1))
+
+
+/* cache_ghost() - remember the key of an object trimmed from fifolist... */
+
+void cache_ghost(struct CACHE **root,unsigned hashval)
+{
+    register struct GHOST *ghost = &ghosts[cache_hashkey(root,hashval) & (GHOSTMAX - 1)];
+    if (ghost->root == NULL) ghostcount++;
+    ghost->root = root;
+    ghost->hashval = hashval;
+}
+
+
+/* cache_ghosthit() - check for (and forget) the ghost of a new object... */
+
+int cache_ghosthit(struct CACHE **root,unsigned hashval)
+{
+    register struct GHOST *ghost = &ghosts[cache_hashkey(root,hashval) & (GHOSTMAX - 1)];
+    if (ghost->root == root && ghost->hashval == hashval) {
+        ghost->root = NULL;
+        ghostcount--;
+        ghosthits++;
+        return 1;
+    }
+    return 0;
+}
+
+
+/* cache_hashinsert() - enter an object in the hash index, doubling the
+   index when it gets full. If memory is short the chains just get longer,
+   or if there is no index at all the object is counted as outside it */
+
+void cache_hashinsert(struct CACHE *cacheobj)
+{
+    register unsigned slot;
+    if ((unsigned) cachecount >= hashsize) {
+        register unsigned newsize = hashsize ? hashsize * 2 : HASHINIT;
+        register struct CACHE **newtable;
+        newtable = (struct CACHE **) calloc(newsize,sizeof(struct CACHE *));
+        if (newtable != NULL) {
+            register struct CACHE **oldtable = hashtable;
+            register unsigned oldsize = hashsize;
+            hashtable = newtable;
+            hashsize = newsize;
+            while (oldsize-- > 0) {
+                register struct CACHE *hashobj = oldtable[oldsize];
+                while (hashobj != NULL) {
+                    register struct CACHE *nextobj = hashobj->hashnext;
+                    slot = cache_hash(hashobj->hashroot,hashobj->hashval);
+                    hashobj->hashnext = hashtable[slot];
+                    hashtable[slot] = hashobj;
+                    hashobj = nextobj;
+                }
+            }
+            free(oldtable);
+        }
+    }
+    if (hashtable == NULL) {
+        cacheobj->hashnext = NULL;
+        hashoutside++;
+    } else {
+        slot = cache_hash(cacheobj->hashroot,cacheobj->hashval);
+        cacheobj->hashnext = hashtable[slot];
+        hashtable[slot] = cacheobj;
+    }
+}
+
+
+/* cache_hashremove() - take an object out of the hash index. One which
+   is not on its chain was never indexed... */
+
+void cache_hashremove(struct CACHE *cacheobj)
+{
+    if (hashtable != NULL) {
+        register struct CACHE **link;
+        link = &hashtable[cache_hash(cacheobj->hashroot,cacheobj->hashval)];
+        while (*link != NULL) {
+            if (*link == cacheobj) {
+                *link = cacheobj->hashnext;
+                return;
+            }
+            link = &(*link)->hashnext;
+        }
+    }
+    hashoutside--;
 }
 
 
@@ -88,18 +619,20 @@ int cache_refcount(struct CACHE *cacheobj)
 {
     register int refcount = 0;
     if (cacheobj != NULL) {
+        CACHE_LOCK();
         refcount = cacheobj->refcount;
         if (cacheobj->left != NULL) refcount += cache_refcount(cacheobj->left);
         if (cacheobj->right != NULL) refcount += cache_refcount(cacheobj->right);
+        CACHE_UNLOCK();
     }
     return refcount;
 }
 
 
-/* cache_delete() - blow away item from cache - allow item to select a proxy (!)
+/* cache_destroy() - blow away item from cache - allow item to select a proxy (!)
    and adjust 'the tree' containing the item. */
 
-struct CACHE *cache_delete(struct CACHE *cacheobj)
+struct CACHE *cache_destroy(struct CACHE *cacheobj)
 {
     while (cacheobj->objmanager != NULL) {
         register struct CACHE *proxyobj;
@@ -151,8 +684,18 @@ struct CACHE *cache_delete(struct CACHE *cacheobj)
             path->balance = 0;
         }
     }
+    cache_hashremove(cacheobj);
+    cachetypecount[CACHETYPE(cacheobj)]--;
+    cachetypebytes[CACHETYPE(cacheobj)] -= cacheobj->objsize;
     cachecount--;
     cachefreecount--;
+    cachefreebytes -= cacheobj->objsize;
+    cacheobj->partition->freecount--;
+    cacheobj->partition->freebytes -= cacheobj->objsize;
+    if (!cacheobj->hot) {
+        cacheobj->partition->fifocount--;
+        cacheobj->partition->fifobytes -= cacheobj->objsize;
+    }
     cachedeletes++;
 #ifdef DEBUG
     cacheobj->nextlru = NULL;
@@ -164,50 +707,110 @@ struct CACHE *cache_delete(struct CACHE *cacheobj)
     cacheobj->hashval = 0;
     cacheobj->balance = 0;
     cacheobj->refcount = 0;
+    cacheobj->hashnext = NULL;
+    cacheobj->hashroot = NULL;
 #endif
-    free(cacheobj);
+    cache_free(cacheobj);
     return cacheobj;
 }
 
 
-/* cache_purge() - trim size of free list */
+/* cache_delete() - delete an object (or its proxy)... */
 
-void cache_purge(void)
+struct CACHE *cache_delete(struct CACHE *cacheobj)
 {
-    if (cachedeleteing == 0) {
-        register struct CACHE *cacheobj = lrulist.lastlru;
-        cachepurges++;
-        while (cachefreecount > CACHEGOAL && cacheobj != &lrulist) {
-            register struct CACHE *lastobj = cacheobj->lastlru;
+    CACHE_LOCK();
+    cacheobj = cache_destroy(cacheobj);
+    CACHE_UNLOCK();
+    return cacheobj;
+}
+
+
+/* cache_evict() - delete the oldest object we can from a free list.
+   Objects trimmed from fifolist leave a ghost behind... */
+
+int cache_evict(struct CACHE *queue)
+{
+    register struct CACHE *cacheobj = queue->lastlru;
+    while (cacheobj != queue) {
+        struct CACHE **root = cacheobj->hashroot;
+        unsigned hashval = cacheobj->hashval;
+        int hot = cacheobj->hot;
 #ifdef DEBUG
-            if (cacheobj->lastlru->nextlru != cacheobj ||
-                cacheobj->nextlru->lastlru != cacheobj ||
-                *(cacheobj->parent) != cacheobj) {
-                printf("CACHE pointers in bad shape!\n");
-            }
+        if (cacheobj->lastlru->nextlru != cacheobj ||
+            cacheobj->nextlru->lastlru != cacheobj ||
+            *(cacheobj->parent) != cacheobj) {
+            printf("CACHE pointers in bad shape!\n");
+        }
 #endif
-            if (cacheobj->refcount == 0) {
-                if (cache_delete(cacheobj) != lastobj) cacheobj = lastobj;
+        if (cacheobj->refcount == 0) {
+            register struct CACHE *delobj = cache_destroy(cacheobj);
+            if (delobj != NULL) {
+                if (delobj == cacheobj && !hot) cache_ghost(root,hashval);
+                return 1;
+            }
+        }
+        cacheobj = cacheobj->lastlru;
+    }
+    return 0;
+}
+
+
+/* cache_trim() - trim the free lists of one partition to half its budget */
+
+void cache_trim(struct PARTITION *part)
+{
+    if (cachedeleteing == 0) {
+        register unsigned long budget = cache_partbudget(part);
+        cachepurges++;
+        part->purges++;
+        while (part->freebytes > budget / 2) {
+            if (part->fifobytes > budget / 4 || part->lrulist.lastlru == &part->lrulist) {
+                if (cache_evict(&part->fifolist) == 0 &&
+                    cache_evict(&part->lrulist) == 0) break;
             } else {
-                cacheobj = lastobj;
+                if (cache_evict(&part->lrulist) == 0 &&
+                    cache_evict(&part->fifolist) == 0) break;
             }
         }
     }
 }
 
 
+/* cache_purge() - trim size of free lists of partitions over budget */
+
+void cache_purge(void)
+{
+    register struct PARTITION *part;
+    CACHE_LOCK();
+    for (part = partitions; part != NULL; part = part->next) {
+        if (part->freebytes > cache_partbudget(part)) cache_trim(part);
+    }
+    CACHE_UNLOCK();
+}
+
+
 
 /* cache_flush() - flush modified entries in cache */
 
 void cache_flush(void)
 {
-    register struct CACHE *cacheobj = lrulist.lastlru;
-    while (cacheobj != &lrulist) {
-        if (cacheobj->objmanager != NULL) {
-            (*cacheobj->objmanager) (cacheobj,1);
-        }
-        cacheobj = cacheobj->lastlru;
+    register struct PARTITION *part;
+    CACHE_LOCK();
+    for (part = partitions; part != NULL; part = part->next) {
+        register struct CACHE *queue = &part->fifolist;
+        do {
+            register struct CACHE *cacheobj = queue->lastlru;
+            while (cacheobj != queue) {
+                if (cacheobj->objmanager != NULL) {
+                    (*cacheobj->objmanager) (cacheobj,1);
+                }
+                cacheobj = cacheobj->lastlru;
+            }
+            queue = (queue == &part->fifolist) ? &part->lrulist : NULL;
+        } while (queue != NULL);
     }
+    CACHE_UNLOCK();
 }
 
 
@@ -216,14 +819,16 @@ void cache_flush(void)
 void cache_remove(struct CACHE *cacheobj)
 {
     if (cacheobj != NULL) {
+        CACHE_LOCK();
         if (cacheobj->left != NULL) cache_remove(cacheobj->left);
         if (cacheobj->right != NULL) cache_remove(cacheobj->right);
         if (cacheobj->refcount == 0) {
             struct CACHE *delobj;
             do {
-                delobj = cache_delete(cacheobj);
+                delobj = cache_destroy(cacheobj);
             } while (delobj != NULL && delobj != cacheobj);
         }
+        CACHE_UNLOCK();
     }
 }
 
@@ -231,6 +836,7 @@ void cache_remove(struct CACHE *cacheobj)
 
 void cache_touch(struct CACHE *cacheobj)
 {
+    CACHE_LOCK();
     if (cacheobj->refcount++ == 0) {
 #ifdef DEBUG
         if (cacheobj->nextlru == NULL || cacheobj->lastlru == NULL) {
@@ -242,31 +848,51 @@ void cache_touch(struct CACHE *cacheobj)
         cacheobj->nextlru = NULL;
         cacheobj->lastlru = NULL;
         cachefreecount--;
+        cachefreebytes -= cacheobj->objsize;
+        cacheobj->partition->freecount--;
+        cacheobj->partition->freebytes -= cacheobj->objsize;
+        if (!cacheobj->hot) {
+            cacheobj->partition->fifocount--;
+            cacheobj->partition->fifobytes -= cacheobj->objsize;
+        }
     }
+    CACHE_UNLOCK();
 }
 
 /* cache_untouch() - to deaccess an object... */
 
 void cache_untouch(struct CACHE *cacheobj,int recycle)
 {
+    CACHE_LOCK();
     if (cacheobj->refcount > 0) {
         if (--cacheobj->refcount == 0) {
-            if (++cachefreecount >= CACHELIM) cache_purge();
+            register struct PARTITION *part = cacheobj->partition;
+            register struct CACHE *queue = &part->lrulist;
+            cachefreecount++;
+            cachefreebytes += cacheobj->objsize;
+            part->freecount++;
+            part->freebytes += cacheobj->objsize;
+            if (!cacheobj->hot) {
+                queue = &part->fifolist;
+                part->fifocount++;
+                part->fifobytes += cacheobj->objsize;
+            }
+            if (part->freebytes > cache_partbudget(part)) cache_trim(part);
 #ifdef DEBUG
             if (cacheobj->nextlru != NULL || cacheobj->lastlru != NULL) {
                 printf("CACHE LRU pointers corrupt\n");
             }
 #endif
             if (recycle) {
-                cacheobj->nextlru = lrulist.nextlru;
-                cacheobj->lastlru = &lrulist;
+                cacheobj->nextlru = queue->nextlru;
+                cacheobj->lastlru = queue;
                 cacheobj->nextlru->lastlru = cacheobj;
-                lrulist.nextlru = cacheobj;
+                queue->nextlru = cacheobj;
             } else {
-                cacheobj->lastlru = lrulist.lastlru;
-                cacheobj->nextlru = &lrulist;
+                cacheobj->lastlru = queue->lastlru;
+                cacheobj->nextlru = queue;
                 cacheobj->lastlru->nextlru = cacheobj;
-                lrulist.lastlru = cacheobj;
+                queue->lastlru = cacheobj;
             }
         }
 #ifdef DEBUG
@@ -274,6 +900,7 @@ void cache_untouch(struct CACHE *cacheobj,int recycle)
         printf("CACHE untouch limit exceeded\n");
 #endif
     }
+    CACHE_UNLOCK();
 }
 
 /* cache_find() - to find or create cache entries...
@@ -288,12 +915,31 @@ void cache_untouch(struct CACHE *cacheobj,int recycle)
         initialize an object if it is not found.
 */
 
-void *cache_find(void **root,unsigned hashval,void *keyval,unsigned *retsts,
+void *cache_search(void **root,unsigned hashval,void *keyval,unsigned *retsts,
                  int (*compare_func) (unsigned hashval,void *keyval,void *node),
                  void *(*create_func) (unsigned hashval,void *keyval,unsigned *retsts))
 {
     register struct CACHE *cacheobj,**parent = (struct CACHE **) root;
     cachefinds++;
+    if (hashtable != NULL && (compare_func == NULL || hashval != 0)) {
+        cacheobj = hashtable[cache_hash(parent,hashval)];
+        while (cacheobj != NULL) {
+            hashprobes++;
+            if (cacheobj->hashroot == parent && cacheobj->hashval == hashval) {
+                if (compare_func == NULL || (*compare_func) (hashval,keyval,cacheobj) == 0) {
+                    hashhits++;
+                    cache_touch(cacheobj);
+                    if (retsts != NULL) *retsts = SS$_NORMAL;
+                    return cacheobj;
+                }
+            }
+            cacheobj = cacheobj->hashnext;
+        }
+        if (create_func == NULL && hashoutside == 0) {
+            if (retsts != NULL) *retsts = SS$_ITEMNOTFOUND;
+            return NULL;
+        }
+    }
     while ((cacheobj = *parent) != NULL) {
         register int cmp = hashval - cacheobj->hashval;
 #ifdef DEBUG
@@ -354,10 +1000,29 @@ void *cache_find(void **root,unsigned hashval,void *keyval,unsigned *retsts,
             cacheobj->hashval = hashval;
             cacheobj->balance = 0;
             cacheobj->refcount = 1;
+            cacheobj->hashroot = (struct CACHE **) root;
+            cacheobj->hot = cache_ghosthit(cacheobj->hashroot,hashval);
             *parent = cacheobj;
+            cache_hashinsert(cacheobj);
+            cachetypecount[CACHETYPE(cacheobj)]++;
+            cachetypebytes[CACHETYPE(cacheobj)] += cacheobj->objsize;
             cachecreated++;
             if (cachecount++ >= cachepeak) cachepeak = cachecount;
         }
     }
     return cacheobj;
 }
+
+
+/* cache_find() - find or create an object under the cache lock... */
+
+void *cache_find(void **root,unsigned hashval,void *keyval,unsigned *retsts,
+                 int (*compare_func) (unsigned hashval,void *keyval,void *node),
+                 void *(*create_func) (unsigned hashval,void *keyval,unsigned *retsts))
+{
+    register void *obj;
+    CACHE_LOCK();
+    obj = cache_search(root,hashval,keyval,retsts,compare_func,create_func);
+    CACHE_UNLOCK();
+    return obj;
+}
@@ -20,6 +20,10 @@
 #define signed
 #endif
 
+struct POOL;			/* Object allocation pools... */
+struct ARENA;
+struct PARTITION;
+
 struct CACHE {
     struct CACHE *nextlru;	/* next object on least recently used list */
     struct CACHE *lastlru;	/* last object on least recently used list */
@@ -31,9 +35,25 @@ struct CACHE {
     short refcount;		/* object reference count */
     signed char balance;	/* object tree imbalance factor */
     signed char objtype;	/* object type (for debugging) */
+    struct CACHE *hashnext;	/* next object in hash index chain */
+    struct CACHE **hashroot;	/* tree this object belongs to */
+    unsigned objsize;		/* bytes allocated for object */
+    unsigned char hot;		/* object goes on frequently used list */
+    struct POOL *pool;		/* pool object came from (or NULL) */
+    struct PARTITION *partition;	/* partition object is kept in */
 };
 
 void cache_show(void);
+void cache_lock(void);
+void cache_unlock(void);
+void cache_wait(unsigned seconds);
+void cache_wake(void);
+void cache_budget(unsigned long bytes);
+void *cache_alloc(struct ARENA *arena,int objtype,unsigned size);
+void cache_free(struct CACHE *cacheobj);
+struct ARENA *cache_arena(int pertype);
+void cache_arenabudget(struct ARENA *arena,unsigned long bytes);
+int cache_arenafree(struct ARENA *arena);
 int cache_refcount(struct CACHE *cacheobj);
 struct CACHE *cache_delete(struct CACHE *cacheobj);
 void cache_purge(void);
@@ -44,4 +64,12 @@ void cache_untouch(struct CACHE * cacheobj,int recycle);
 void *cache_find(void **root,unsigned hashval,void *keyval,unsigned *retsts,
                  int (*compare_func) (unsigned hashval,void *keyval,void *node),
                  void *(*create_func) (unsigned hashval,void *keyval,unsigned *retsts));
+
+/* CACHE_COUNT() bumps a statistics counter shared by every thread */
+
+#ifdef CACHE_THREADS
+#define CACHE_COUNT(counter) (cache_lock(),(counter)++,cache_unlock())
+#else
+#define CACHE_COUNT(counter) ((counter)++)
+#endif
 #endif
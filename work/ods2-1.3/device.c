@@ -28,25 +28,25 @@
 void *device_create(unsigned devsiz,void *keyval,unsigned *retsts)
 {
     register char *devnam = (char *) keyval;
-    register struct DEV *dev = (struct DEV *) malloc(sizeof(struct DEV) + devsiz + 2);
+    register struct DEV *dev = (struct DEV *) cache_alloc(NULL,1,sizeof(struct DEV) + devsiz + 2);
     if (dev == NULL) {
         *retsts = SS$_INSFMEM;
     } else {
         register unsigned sts;
         struct phyio_info info;
         dev->cache.objmanager = NULL;
-        dev->cache.objtype = 1;
         memcpy(dev->devnam,devnam,devsiz);
         memcpy(dev->devnam + devsiz,":",2);
         sts = phyio_init(devsiz + 1,dev->devnam,&dev->handle,&info);
         *retsts = sts;
         if (sts & 1) {
             dev->vcb = NULL;
+            dev->claim = NULL;
             dev->status = info.status;
             dev->sectors = info.sectors;
             dev->sectorsize = info.sectorsize;
         } else {
-            free(dev);
+            cache_free(&dev->cache);
             dev = NULL;
         }
     }
@@ -69,7 +69,8 @@ int device_compare(unsigned keylen,void *keyval,void *node)
     return cmp;
 }
 
-/* device_lookup() is to to find devices... */
+/* device_lookup() is to to find devices. The device table is shared by
+   every context, so that a device is only ever mounted once... */
 
 struct DEV *dev_root = NULL;
 
@@ -92,3 +93,29 @@ unsigned device_lookup(unsigned devlen,char *devnam,
     }
     return sts;
 }
+
+/* device_claim() reserves a device for a volume being mounted, failing
+   if another volume (from any context) already has it... */
+
+unsigned device_claim(struct DEV *dev,struct VCB *vcb)
+{
+    register unsigned sts = SS$_NORMAL;
+    cache_lock();
+    if (dev->claim != NULL) {
+        sts = SS$_DEVMOUNT;
+    } else {
+        dev->claim = vcb;
+    }
+    cache_unlock();
+    return sts;
+}
+
+/* device_release() gives up the claim once the volume is dismounted
+   (or failed to mount)... */
+
+void device_release(struct DEV *dev)
+{
+    cache_lock();
+    dev->claim = NULL;
+    cache_unlock();
+}
@@ -29,23 +29,24 @@
 #define MAXREC (BLOCKSIZE - 2)
 
 
-/* Some statistical counters... */
+/* Some statistical counters (shared by every context, so they are
+   bumped with CACHE_COUNT())... */
 
 int direct_lookups = 0;
 int direct_searches = 0;
 int direct_deletes = 0;
 int direct_inserts = 0;
 int direct_splits = 0;
-int direct_checks = 0;
-int direct_matches = 0;
+int direct_indexed = 0;
 
 
 /* direct_show - to print directory statistics */
 
 void direct_show(void)
 {
-    printf("DIRECT_SHOW Lookups: %d Searches: %d Deletes: %d Inserts: %d Splits: %d\n",
-           direct_lookups,direct_searches,direct_deletes,direct_inserts,direct_splits);
+    printf("DIRECT_SHOW Lookups: %d Searches: %d Deletes: %d Inserts: %d Splits: %d Indexed: %d\n",
+           direct_lookups,direct_searches,direct_deletes,direct_inserts,direct_splits,
+           direct_indexed);
 }
 
 
@@ -59,7 +60,6 @@ unsigned name_check(char *str,int len,int *retlen,int *retver,int *wildflag)
     register int dots = 0;
     register char *name = name_start;
     register char *name_end = name + len;
-    direct_checks++;
 
     /* Go through the specification checking for illegal characters */
 
@@ -128,7 +128,6 @@ int name_match(char *spec,int spec_len,char *dirent,int dirent_len)
     int percent = MAT_GT;
     register char *name = spec,*entry = dirent;
     register char *name_end = name + spec_len,*entry_end = entry + dirent_len;
-    direct_matches++;
 
     /* See how much name matches without wildcards... */
 
@@ -233,6 +232,149 @@ int name_match(char *spec,int spec_len,char *dirent,int dirent_len)
 }
 
 
+/* Large directories are given a hash index of their names the first
+   time one is looked up, so that opening a file by its exact name needs
+   no directory blocks at all. The index hangs off the directory FCB like
+   its window, keeps the entries of each name in directory order (highest
+   version first), and is thrown away whenever an entry is inserted or
+   deleted - the next lookup builds it again... */
+
+#define DIRINDEX_MIN 8          /* Smallest directory (blocks) indexed */
+
+struct DIRNAME {
+    int next;                   /* Next name in hash chain (or -1) */
+    unsigned nameoff;           /* Offset of name text in pool */
+    unsigned first;             /* First entry for this name */
+    unsigned count;             /* Entries for this name */
+    unsigned namelen;           /* Length of name */
+};
+
+struct DIRINDEX {
+    struct CACHE cache;
+    unsigned eofblk;            /* Directory end of file when indexed */
+    unsigned hashmask;          /* Hash table size less one */
+    int *hashtab;               /* First name in each hash chain */
+    struct DIRNAME *names;      /* Names in directory order */
+    struct dir$ent *entries;    /* Entries of all names */
+    char *pool;                 /* Name text */
+};
+
+
+/* dir_eofblk() - last directory block in use */
+
+unsigned dir_eofblk(struct FCB * fcb)
+{
+    register unsigned eofblk = VMSSWAP(fcb->head->fh2$w_recattr.fat$l_efblk);
+    if (VMSWORD(fcb->head->fh2$w_recattr.fat$w_ffbyte) == 0) --eofblk;
+    return eofblk;
+}
+
+
+/* dir_hash() - hash a name regardless of case */
+
+unsigned dir_hash(char *name,int len)
+{
+    register unsigned hash = 0;
+    while (len-- > 0) hash = hash * 31 + toupper(*name++);
+    return hash;
+}
+
+
+/* dirindex_create() - read a whole directory to build its index. The
+   first pass sizes the index and the second fills it in... */
+
+void *dirindex_create(unsigned hashval,void *keyval,unsigned *retsts)
+{
+    register struct FCB *fcb = (struct FCB *) keyval;
+    register struct DIRINDEX *dirindex = NULL;
+    unsigned eofblk = dir_eofblk(fcb);
+    unsigned names = 0,entries = 0,poolsize = 0,buckets = 16;
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        register unsigned sts = SS$_NORMAL,curblk;
+        unsigned nameno = 0,entno = 0,poolused = 0;
+        for (curblk = 1; curblk <= eofblk; curblk++) {
+            struct VIOC *vioc;
+            char *buffer;
+            register struct dir$rec *dr;
+            sts = accesschunk(fcb,curblk,&vioc,&buffer,NULL,0);
+            if ((sts & 1) == 0) break;
+            dr = (struct dir$rec *) buffer;
+            do {
+                register char *nr = (char *) dr + VMSWORD(dr->dir$size) + 2;
+                register struct dir$ent *de = (struct dir$ent *) (dr->dir$name +
+                                                                  ((dr->dir$namecount + 1) & ~1));
+                register unsigned count;
+                if (nr >= buffer + BLOCKSIZE) break;
+                if (dr->dir$name + dr->dir$namecount >= nr) break;
+                count = (nr - (char *) de) / sizeof(struct dir$ent);
+                if (pass == 0) {
+                    names++;
+                    entries += count;
+                    poolsize += dr->dir$namecount;
+                } else {
+                    register struct DIRNAME *dn = NULL;
+                    if (nameno + 1 > names || entno + count > entries ||
+                        poolused + dr->dir$namecount > poolsize) {
+                        sts = SS$_BADIRECTORY;  /* Changed under us! */
+                        break;
+                    }
+                    if (nameno > 0) dn = &dirindex->names[nameno - 1];
+                    if ((char *) dr != buffer || dn == NULL ||
+                        dn->namelen != dr->dir$namecount ||
+                        memcmp(dirindex->pool + dn->nameoff,dr->dir$name,dn->namelen) != 0) {
+                        register unsigned hash = dir_hash(dr->dir$name,dr->dir$namecount) &
+                            dirindex->hashmask;
+                        dn = &dirindex->names[nameno];
+                        dn->next = dirindex->hashtab[hash];
+                        dn->nameoff = poolused;
+                        dn->first = entno;
+                        dn->count = 0;
+                        dn->namelen = dr->dir$namecount;
+                        memcpy(dirindex->pool + poolused,dr->dir$name,dn->namelen);
+                        poolused += dn->namelen;
+                        dirindex->hashtab[hash] = nameno++;
+                    }
+                    memcpy(dirindex->entries + entno,de,count * sizeof(struct dir$ent));
+                    entno += count;
+                    dn->count += count;
+                }
+                dr = (struct dir$rec *) nr;
+            } while (1);
+            deaccesschunk(vioc,0,0,1);
+            if ((sts & 1) == 0) break;
+        }
+        if ((sts & 1) == 0) {
+            if (dirindex != NULL) cache_free(&dirindex->cache);
+            *retsts = sts;
+            return NULL;
+        }
+        if (pass == 0) {
+            while (buckets < names) buckets *= 2;
+            dirindex = (struct DIRINDEX *) cache_alloc(fcb->vcb->arena,4,
+                                                       sizeof(struct DIRINDEX) +
+                                                       names * sizeof(struct DIRNAME) +
+                                                       buckets * sizeof(int) +
+                                                       entries * sizeof(struct dir$ent) +
+                                                       poolsize);
+            if (dirindex == NULL) {
+                *retsts = SS$_INSFMEM;
+                return NULL;
+            }
+            dirindex->cache.objmanager = NULL;
+            dirindex->eofblk = eofblk;
+            dirindex->hashmask = buckets - 1;
+            dirindex->names = (struct DIRNAME *) (dirindex + 1);
+            dirindex->hashtab = (int *) (dirindex->names + names);
+            dirindex->entries = (struct dir$ent *) (dirindex->hashtab + buckets);
+            dirindex->pool = (char *) (dirindex->entries + entries);
+            memset(dirindex->hashtab,-1,buckets * sizeof(int));
+        }
+    }
+    return dirindex;
+}
+
+
 /* insert_ent() - procedure to add a directory entry at record dr entry de */
 
 unsigned insert_ent(struct FCB * fcb,unsigned eofblk,unsigned curblk,
@@ -247,7 +389,8 @@ unsigned insert_ent(struct FCB * fcb,unsigned eofblk,unsigned curblk,
     /* Compute space required... */
 
     register int addlen = sizeof(struct dir$ent);
-    direct_inserts++;
+    CACHE_COUNT(direct_inserts);
+    cache_remove((struct CACHE *) fcb->dirindex);
     if (de == NULL)
         addlen += (filelen + sizeof(struct dir$rec)) & ~1;
 
@@ -293,7 +436,7 @@ unsigned insert_ent(struct FCB * fcb,unsigned eofblk,unsigned curblk,
         char *newbuf;
         struct VIOC *newvioc;
         unsigned newblk = eofblk + 1;
-        direct_splits++;
+        CACHE_COUNT(direct_splits);
         printf("Splitting record... %d %d\n",dr,de);
         if (newblk > fcb->hiblock) {
             printf("I can't extend a directory yet!!\n");
@@ -411,7 +554,8 @@ unsigned delete_ent(struct FCB * fcb,struct VIOC * vioc,unsigned curblk,
 {
     unsigned sts = 1;
     unsigned ent;
-    direct_deletes++;
+    CACHE_COUNT(direct_deletes);
+    cache_remove((struct CACHE *) fcb->dirindex);
     ent = (VMSWORD(dr->dir$size) - sizeof(struct dir$rec)
            - dr->dir$namecount + 3) / sizeof(struct dir$ent);
     if (ent > 1) {
@@ -449,20 +593,18 @@ unsigned delete_ent(struct FCB * fcb,struct VIOC * vioc,unsigned curblk,
 }
 
 
-/* return_ent() - return information about a directory entry */
+/* return_name() - return the name, version and file id of an entry */
 
-unsigned return_ent(struct FCB * fcb,struct VIOC * vioc,unsigned curblk,
-                    struct dir$rec * dr,struct dir$ent * de,struct fibdef * fib,
-                    unsigned short *reslen,struct dsc_descriptor * resdsc,
-                    int wildcard)
+void return_name(struct FCB * fcb,char *name,int length,struct dir$ent * de,
+                 struct fibdef * fib,unsigned short *reslen,
+                 struct dsc_descriptor * resdsc)
 {
     register int scale = 10;
     register int version = VMSWORD(de->dir$version);
-    register int length = dr->dir$namecount;
     register char *ptr = resdsc->dsc_a_pointer;
     register int outlen = resdsc->dsc_w_length;
     if (length > outlen) length = outlen;
-    memcpy(ptr,dr->dir$name,length);
+    memcpy(ptr,name,length);
     while (version >= scale) scale *= 10;
     ptr += length;
     if (length < outlen) {
@@ -479,6 +621,17 @@ unsigned return_ent(struct FCB * fcb,struct VIOC * vioc,unsigned curblk,
     *reslen = length;
     fid_copy((struct fiddef *)&fib->fib$w_fid_num,&de->dir$fid,0);
     if (fib->fib$b_fid_rvn == 0) fib->fib$b_fid_rvn = fcb->rvn;
+}
+
+
+/* return_ent() - return information about a directory entry */
+
+unsigned return_ent(struct FCB * fcb,struct VIOC * vioc,unsigned curblk,
+                    struct dir$rec * dr,struct dir$ent * de,struct fibdef * fib,
+                    unsigned short *reslen,struct dsc_descriptor * resdsc,
+                    int wildcard)
+{
+    return_name(fcb,dr->dir$name,dr->dir$namecount,de,fib,reslen,resdsc);
     if (wildcard || (fib->fib$w_nmctl & FIB$M_WILD)) {
         fib->fib$l_wcc = curblk;
     } else {
@@ -488,6 +641,43 @@ unsigned return_ent(struct FCB * fcb,struct VIOC * vioc,unsigned curblk,
 }
 
 
+/* dirindex_lookup() - find an exact name in a directory index. Versions
+   select just as they do in a search: zero is the highest, negative
+   counts back from it, otherwise it must match... */
+
+unsigned dirindex_lookup(struct FCB * fcb,struct DIRINDEX * dirindex,
+                         char *searchspec,int searchlen,int version,
+                         struct fibdef * fib,unsigned short *reslen,
+                         struct dsc_descriptor * resdsc)
+{
+    register int nameno;
+    CACHE_COUNT(direct_indexed);
+    fib->fib$l_wcc = 0;
+    nameno = dirindex->hashtab[dir_hash(searchspec,searchlen) & dirindex->hashmask];
+    while (nameno >= 0) {
+        register struct DIRNAME *dn = &dirindex->names[nameno];
+        if (dn->namelen == searchlen &&
+            name_match(searchspec,searchlen,dirindex->pool + dn->nameoff,
+                       dn->namelen) == MAT_EQ) {
+            register struct dir$ent *de = dirindex->entries + dn->first;
+            register unsigned ent = 0;
+            if (version < 1) {
+                ent = -version;
+            } else {
+                while (ent < dn->count && VMSWORD(de[ent].dir$version) > version) ent++;
+                if (ent < dn->count && VMSWORD(de[ent].dir$version) != version) break;
+            }
+            if (ent >= dn->count) break;
+            return_name(fcb,dirindex->pool + dn->nameoff,dn->namelen,&de[ent],
+                        fib,reslen,resdsc);
+            return SS$_NORMAL;
+        }
+        nameno = dn->next;
+    }
+    return SS$_NOSUCHFILE;
+}
+
+
 /* search_ent() - search for a directory entry */
 
 unsigned search_ent(struct FCB * fcb,
@@ -499,7 +689,7 @@ unsigned search_ent(struct FCB * fcb,
     char *searchspec,*buffer;
     int searchlen,version,wildcard,wcc_flag;
     struct fibdef *fib = (struct fibdef *) fibdsc->dsc_a_pointer;
-    direct_lookups++;
+    CACHE_COUNT(direct_lookups);
 
     /* 1) Generate start block (wcc gives start point)
        2) Search for start
@@ -519,6 +709,25 @@ unsigned search_ent(struct FCB * fcb,
     }
     if ((sts & 1) == 0) return sts;
 
+    /* An exact name in a large directory can come from its index... */
+
+    if (curblk == 0 && action == 0 && wildcard == 0 &&
+        (fib->fib$w_nmctl & FIB$M_WILD) == 0 && eofblk >= DIRINDEX_MIN) {
+        struct DIRINDEX *dirindex;
+        unsigned idxsts;
+        dirindex = cache_find((void *) &fcb->dirindex,0,fcb,&idxsts,NULL,dirindex_create);
+        if (dirindex != NULL) {
+            if (dirindex->eofblk == eofblk) {
+                sts = dirindex_lookup(fcb,dirindex,searchspec,searchlen,version,
+                                      fib,reslen,resdsc);
+                cache_untouch(&dirindex->cache,1);
+                return sts;
+            }
+            cache_untouch(&dirindex->cache,0);
+            cache_remove(&dirindex->cache);
+        }
+    }
+
 
     /* Identify starting block...*/
 
@@ -531,7 +740,7 @@ unsigned search_ent(struct FCB * fcb,
             register int cmp;
             register unsigned newblk;
             register struct dir$rec *dr;
-            direct_searches++;
+            CACHE_COUNT(direct_searches);
             sts = accesschunk(fcb,curblk,&vioc,&buffer,NULL,action ? 1 : 0);
             if ((sts & 1) == 0) return sts;
             dr = (struct dir$rec *) buffer;
@@ -756,11 +965,11 @@ unsigned direct(struct VCB * vcb,struct dsc_descriptor * fibdsc,
     struct FCB *fcb;
     register unsigned sts,eofblk;
     register struct fibdef *fib = (struct fibdef *) fibdsc->dsc_a_pointer;
+    if (action) access_begin();
     sts = accessfile(vcb,(struct fiddef *) & fib->fib$w_did_num,&fcb,action);
     if (sts & 1) {
         if (VMSLONG(fcb->head->fh2$l_filechar) & FH2$M_DIRECTORY) {
-            eofblk = VMSSWAP(fcb->head->fh2$w_recattr.fat$l_efblk);
-            if (VMSWORD(fcb->head->fh2$w_recattr.fat$w_ffbyte) == 0) --eofblk;
+            eofblk = dir_eofblk(fcb);
             sts = search_ent(fcb,fibdsc,filedsc,reslen,resdsc,eofblk,action);
         } else {
             sts = SS$_BADIRECTORY;
@@ -770,5 +979,6 @@ unsigned direct(struct VCB * vcb,struct dsc_descriptor * fibdsc,
             if (sts & 1) sts = dests;
         }
     }
+    if (action) access_end();
     return sts;
 }
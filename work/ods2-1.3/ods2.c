@@ -75,6 +75,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 
 #ifdef VMSIO
@@ -104,6 +105,7 @@
 #include "ssdef.h"
 #include "descrip.h"
 #include "access.h"
+#include "phyio.h"
 #include "rms.h"
 #endif
 
@@ -122,6 +124,28 @@ int keycomp(char *param,char *keywrd)
 }
 
 
+/* checkvalue: routine to find a qualifier of the form keyword=value. The
+   qualifier is removed from the list and a pointer to its value returned */
+
+char *checkvalue(char *keywrd,int *qualc,char *qualv[])
+{
+    int i;
+    for (i = 0; i < *qualc; i++) {
+        char *value = strchr(qualv[i],'=');
+        if (value != NULL) {
+            *value++ = '\0';
+            if (keycomp(qualv[i],keywrd)) {
+                while (++i < *qualc) qualv[i - 1] = qualv[i];
+                (*qualc)--;
+                return value;
+            }
+            *--value = '=';
+        }
+    }
+    return NULL;
+}
+
+
 /* checkquals: routine to find a qualifer in a list of possible values */
 
 int checkquals(char *qualset[],int qualc,char *qualv[])
@@ -768,6 +792,36 @@ void setdef(char *newdef)
     }
 }
 
+/* getsize: convert a size such as 64M into bytes, complaining about
+   anything after the number but a K, M or G, or a size too big */
+
+unsigned getsize(char *str,unsigned long *retsize)
+{
+    char *end;
+    int shift = 0;
+    unsigned long size;
+    errno = 0;
+    size = strtoul(str,&end,10);
+    switch (tolower(*end)) {
+        case 'g':
+            shift += 10;
+            /* fall through */
+        case 'm':
+            shift += 10;
+            /* fall through */
+        case 'k':
+            shift += 10;
+            end++;
+    }
+    if (!isdigit(*str) || *end != '\0' || errno == ERANGE ||
+        (size << shift) >> shift != size) {
+        printf("%%ODS2-E-BADSIZE, Invalid size '%s'\n",str);
+        return SS$_BADPARAM;
+    }
+    *retsize = size << shift;
+    return SS$_NORMAL;
+}
+
 /* set: the set command */
 
 unsigned set(int argc,char *argv[],int qualc,char *qualv[])
@@ -775,6 +829,12 @@ unsigned set(int argc,char *argv[],int qualc,char *qualv[])
     unsigned sts = 1;
     if (keycomp(argv[1],"default")) {
         setdef(argv[2]);
+#ifndef VMSIO
+    } else if (keycomp(argv[1],"cache")) {
+        unsigned long size;
+        sts = getsize(argv[2],&size);
+        if (sts & 1) cache_budget(size);
+#endif
     } else {
         printf("%%SET-W-WHAT '%s'?\n",argv[1]);
     }
@@ -803,7 +863,7 @@ unsigned dodismount(int argc,char *argv[],int qualc,char *qualv[])
 
 
 
-char *mouquals[] = {"write",NULL};
+char *mouquals[] = {"write","map","direct","partition","journal","overlay",NULL};
 
 unsigned domount(int argc,char *argv[],int qualc,char *qualv[])
 {
@@ -811,7 +871,13 @@ unsigned domount(int argc,char *argv[],int qualc,char *qualv[])
     char *lab = argv[2];
     int sts = 1,devices = 0;
     char *devs[100],*labs[100];
+    char *chunk = checkvalue("chunk",&qualc,qualv);
+    char *cache = checkvalue("cache",&qualc,qualv);
     int options = checkquals(mouquals,qualc,qualv);
+    unsigned chunksize = VIOC_CHUNKSIZE;
+    unsigned long cachesize = 0;
+    if (chunk != NULL) chunksize = atoi(chunk);
+    if (cache != NULL && !(getsize(cache,&cachesize) & 1)) return SS$_BADPARAM;
     while (*lab != '\0') {
         labs[devices++] = lab;
         while (*lab != ',' && *lab != '\0') lab++;
@@ -834,13 +900,14 @@ unsigned domount(int argc,char *argv[],int qualc,char *qualv[])
     if (devices > 0) {
         unsigned i;
         struct VCB *vcb;
-        sts = mount(options,devices,devs,labs,&vcb);
+        sts = mount(options,chunksize,devices,devs,labs,&vcb);
         if (sts & 1) {
+            if (cache != NULL) cache_arenabudget(vcb->arena,cachesize);
             for (i = 0; i < vcb->devices; i++)
                 if (vcb->vcbdev[i].dev != NULL)
                     printf("%%MOUNT-I-MOUNTED, Volume %12.12s mounted on %s\n",
                            vcb->vcbdev[i].home.hm2$t_volname,vcb->vcbdev[i].dev->devnam);
-            if (setdef_count == 0) {
+            if (setdef_count == 0 && strlen(vcb->vcbdev[0].dev->devnam) < 256 - 9) {
                 char *colon,defdir[256];
                 strcpy(defdir,vcb->vcbdev[0].dev->devnam);
                 colon = strchr(defdir,':');
@@ -857,7 +924,81 @@ unsigned domount(int argc,char *argv[],int qualc,char *qualv[])
 }
 
 
+/* dooverlay: commit or discard the overlay of a dismounted device */
+
+char *ovlquals[] = {"commit","discard",NULL};
+
+unsigned dooverlay(int argc,char *argv[],int qualc,char *qualv[])
+{
+    struct DEV *dev;
+    int options = checkquals(ovlquals,qualc,qualv);
+    register unsigned sts = SS$_BADPARAM;
+    if (options == 1 || options == 2) {
+        sts = device_lookup(strlen(argv[1]),argv[1],1,&dev);
+        if (sts & 1) {
+            if (dev->vcb != NULL) {
+                sts = SS$_DEVMOUNT;
+            } else {
+                sts = phyio_overlay(dev->handle,dev->devnam,
+                                    options == 1 ? OVERLAY_COMMIT : OVERLAY_DISCARD);
+            }
+        }
+    }
+    if (sts & 1) {
+        printf("%%OVERLAY-I-%s, overlay of %s %s\n",options == 1 ? "COMMITTED" : "DISCARDED",
+               dev->devnam,options == 1 ? "committed" : "discarded");
+    } else {
+        printf("%%OVERLAY-E-STATUS Error: %d\n",sts);
+    }
+    return sts;
+}
+
+
+/* doindex: scan the index file of a mounted volume in one pass */
+
+char *idxquals[] = {"full",NULL};
+
+unsigned doindex(int argc,char *argv[],int qualc,char *qualv[])
+{
+    struct DEV *dev;
+    int options = checkquals(idxquals,qualc,qualv);
+    register unsigned sts = device_lookup(strlen(argv[1]),argv[1],0,&dev);
+    if (sts & 1) {
+        if (dev->vcb != NULL) {
+            register unsigned rvn;
+            for (rvn = 1; rvn <= dev->vcb->devices; rvn++) {
+                struct HEADINFO *table = NULL;
+                unsigned count,bad;
+                if (dev->vcb->vcbdev[rvn - 1].dev == NULL) continue;
+                sts = access_scanindex(dev->vcb,rvn,&table,&count,&bad);
+                if ((sts & 1) == 0) break;
+                if (options & 1) {
+                    register unsigned i;
+                    for (i = 0; i < count; i++) {
+                        register struct HEADINFO *info = &table[i];
+                        printf("  (%d,%d,%d) seg %d back (%d,%d,%d) %u blocks%s\n",
+                               info->fid.fid$w_num + (info->fid.fid$b_nmx << 16),
+                               info->fid.fid$w_seq,info->fid.fid$b_rvn,info->seg_num,
+                               info->backlink.fid$w_num + (info->backlink.fid$b_nmx << 16),
+                               info->backlink.fid$w_seq,info->backlink.fid$b_rvn,info->hiblk,
+                               (info->filechar & FH2$M_DIRECTORY) ? " directory" : "");
+                    }
+                }
+                printf("%%INDEX-I-HEADERS, %s %u headers in use, %u bad\n",
+                       dev->vcb->vcbdev[rvn - 1].dev->devnam,count,bad);
+                if (table != NULL) free(table);
+            }
+        } else {
+            sts = SS$_DEVNOTMOUNT;
+        }
+    }
+    if ((sts & 1) == 0) printf("%%INDEX-E-STATUS Error: %d\n",sts);
+    return sts;
+}
+
+
 void direct_show(void);
+void rms_show(void);
 void phyio_show(void);
 
 /* statis: print some simple statistics */
@@ -866,7 +1007,9 @@ unsigned statis(int argc,char *argv[],int qualc,char *qualv[])
 {
     printf("Statistics:-\n");
     direct_show();
+    rms_show();
     cache_show();
+    access_show();
     phyio_show();
     return 1;
 }
@@ -883,10 +1026,12 @@ unsigned help(int argc,char *argv[],int qualc,char *qualv[])
     printf(" Commands are:\n");
     printf("  copy        difference      directory     exit\n");
     printf("  mount       show_default    show_time     search\n");
-    printf("  set_default type\n");
+    printf("  index       set_cache     set_default   type\n");
+    printf("  overlay\n");
     printf(" Example:-\n    $ mount e:\n");
     printf("    $ search e:[vms_common.decc*...]*.h rms$_wld\n");
     printf("    $ set default e:[sys0.sysmgr]\n");
+    printf("    $ set cache 64M\n");
     printf("    $ copy *.com;-1 c:\\*.*\n");
     printf("    $ directory/file/size/date [-.sys*...].%%\n");
     printf("    $ exit\n");
@@ -945,7 +1090,13 @@ struct CMDSET {
         "dismount",dodismount,3,2,2,0
 },
     {
-        "mount",domount,3,2,3,2
+        "index",doindex,3,2,2,1
+},
+    {
+        "mount",domount,3,2,3,8
+},
+    {
+        "overlay",dooverlay,3,2,2,1
 },
     {
         "statistics",statis,3,1,1,0
@@ -1077,7 +1228,18 @@ int main(int argc,char *argv[])
 {
     char str[2048];
     FILE *atfile = NULL;
+    int i;
     printf(" ODS2 %s\n", MODULE_IDENT);
+    for (i = 1; i < argc; i++) {
+#ifndef VMSIO
+        if (strncmp(argv[i],"-cache=",7) == 0) {
+            unsigned long size;
+            if (getsize(argv[i] + 7,&size) & 1) cache_budget(size);
+            continue;
+        }
+#endif
+        printf("%%ODS2-W-ILLOPT, Unknown option '%s' ignored\n",argv[i]);
+    }
     while (1) {
         char *ptr;
         if (atfile != NULL) {
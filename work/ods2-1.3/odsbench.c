@@ -0,0 +1,261 @@
+/* Odsbench.c v1.3  Timing of the ODS2 access routines */
+
+/*
+        This is part of ODS2 written by Paul Nankervis,
+        email address:  Paulnank@au1.ibm.com
+
+        ODS2 is distributed freely for all members of the
+        VMS community to use. However all derived works
+        must maintain comments in their source to acknowledge
+        the contibution of the original author.
+*/
+
+/*
+        odsbench times pieces of the access layer on their own, so that
+        a change to one can be measured rather than guessed at:-
+
+            odsbench checksum [passes]
+                        sums random headers with checksum() and with the
+                        original one word at a time loop, checks that the
+                        two agree and prints the time each took. Build with
+                        -DNO_SSE2 to time the longword loop instead.
+
+            odsbench threads device [threads] [passes] [budget]
+                        mounts device read only and has 1, 2, 4... up to
+                        threads threads read every file on it through
+                        accesschunk() at once, each starting at a different
+                        file, and prints the rate for each count and its
+                        speedup over one thread. The cache budget (bytes,
+                        default small) keeps chunks coming from the device.
+                        Needs a build with -DCACHE_THREADS -lpthread.
+
+        It is built from the same objects as ods2 (see makefile.unix).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ssdef.h"
+#include "access.h"
+#include "cache.h"
+
+#ifdef CACHE_THREADS
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#define BENCH_HEADERS 4096      /* Headers in the test buffer */
+#define BENCH_PASSES 2000       /* Passes over the buffer */
+#define BENCH_THREADS 8         /* Most threads timed together */
+#define BENCH_BUDGET 262144     /* Cache budget while they run */
+
+
+/* word_checksum() is the checksum as first written: one word at a time */
+
+unsigned short word_checksum(vmsword *block)
+{
+    register int count = 255;
+    register unsigned result = 0;
+    register unsigned short *ptr = block;
+    do {
+        register unsigned data = *ptr++;
+        result += VMSWORD(data);
+    } while (--count > 0);
+    return result;
+}
+
+
+/* bench_usage() lists the benchmarks */
+
+int bench_usage(void)
+{
+    printf("Usage: odsbench checksum [passes]\n");
+    printf("       odsbench threads device [threads] [passes] [budget]\n");
+    return 1;
+}
+
+
+/* bench_checksum() times both checksums over the same headers */
+
+int bench_checksum(int argc,char *argv[])
+{
+    register unsigned head,pass;
+    unsigned passes = BENCH_PASSES;
+    unsigned long total[2];
+    double seconds[2];
+    clock_t start;
+    vmsword *heads;
+    unsigned i;
+    if (argc > 2) passes = atoi(argv[2]);
+    heads = (vmsword *) malloc(BENCH_HEADERS * 512 + 2);
+    if (heads == NULL) return 1;
+    heads++;                    /* Headers need not be 16 byte aligned */
+    srand(1);
+    for (i = 0; i < BENCH_HEADERS * 256; i++) heads[i] = rand();
+    for (head = 0; head < BENCH_HEADERS; head++) {
+        if (checksum(heads + head * 256) != word_checksum(heads + head * 256)) {
+            printf("Checksums differ for header %u\n",head);
+            return 1;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        total[i] = 0;
+        start = clock();
+        for (pass = 0; pass < passes; pass++) {
+            for (head = 0; head < BENCH_HEADERS; head++) {
+                total[i] += i ? word_checksum(heads + head * 256) : checksum(heads + head * 256);
+            }
+        }
+        seconds[i] = (double) (clock() - start) / CLOCKS_PER_SEC;
+    }
+    printf("CHECKSUM %u headers: checksum() %.3fs (%.1f ns each) word loop %.3fs (%.1f ns each)\n",
+           passes * BENCH_HEADERS,seconds[0],seconds[0] * 1e9 / passes / BENCH_HEADERS,
+           seconds[1],seconds[1] * 1e9 / passes / BENCH_HEADERS);
+    if (seconds[0] > 0) printf(" - speedup %.2f (sums %lu %lu)\n",seconds[1] / seconds[0],total[0],total[1]);
+    return total[0] != total[1];
+}
+
+
+#ifdef CACHE_THREADS
+
+struct BENCHRUN {
+    struct VCB *vcb;            /* Volume being read */
+    struct HEADINFO *files;     /* Files to read... */
+    unsigned nfiles;            /* ...and how many */
+    unsigned passes;            /* Times each thread reads them all */
+    unsigned first;             /* File this thread starts at */
+    unsigned long blocks;       /* Blocks it read */
+    unsigned sts;               /* First failure */
+};
+
+
+/* bench_reader() reads every file of a run, one chunk at a time */
+
+void *bench_reader(void *arg)
+{
+    register struct BENCHRUN *run = (struct BENCHRUN *) arg;
+    register unsigned pass,file;
+    for (pass = 0; pass < run->passes; pass++) {
+        for (file = 0; file < run->nfiles; file++) {
+            register struct HEADINFO *info = &run->files[(run->first + file) % run->nfiles];
+            register unsigned sts;
+            struct FCB *fcb;
+            unsigned vbn = 1;
+            sts = accessfile(run->vcb,&info->fid,&fcb,0);
+            if ((sts & 1) == 0) {
+                run->sts = sts;
+                return NULL;
+            }
+            while (vbn <= info->hiblk) {
+                struct VIOC *vioc;
+                char *buffer;
+                unsigned blocks;
+                sts = accesschunk(fcb,vbn,&vioc,&buffer,&blocks,0);
+                if ((sts & 1) == 0) break;
+                deaccesschunk(vioc,0,0,1);
+                run->blocks += blocks;
+                vbn += blocks;
+            }
+            deaccessfile(fcb);
+            if ((sts & 1) == 0 && sts != SS$_ENDOFFILE) {
+                run->sts = sts;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/* bench_threads() times readers on a volume, doubling their number */
+
+int bench_threads(int argc,char *argv[])
+{
+    unsigned maxthreads = BENCH_THREADS,passes = 4,threads,i;
+    unsigned long budget = BENCH_BUDGET;
+    struct BENCHRUN run[BENCH_THREADS];
+    pthread_t thread[BENCH_THREADS];
+    struct HEADINFO *table;
+    unsigned count,bad,kept,sts;
+    double rate,onerate = 0;
+    char *devnam[1];
+    struct VCB *vcb;
+    if (argc < 3) return bench_usage();
+    devnam[0] = argv[2];
+    if (argc > 3) maxthreads = atoi(argv[3]);
+    if (maxthreads < 1 || maxthreads > BENCH_THREADS) maxthreads = BENCH_THREADS;
+    if (argc > 4) passes = atoi(argv[4]);
+    if (argc > 5) budget = atol(argv[5]);
+    sts = mount(0,0,1,devnam,NULL,&vcb);
+    if ((sts & 1) == 0) {
+        printf("Mount of %s failed %d\n",argv[2],sts);
+        return 1;
+    }
+    sts = access_scanindex(vcb,0,&table,&count,&bad);
+    if ((sts & 1) == 0) {
+        printf("Index scan failed %d\n",sts);
+        dismount(vcb);
+        return 1;
+    }
+    for (i = 0, kept = 0; i < count; i++) {
+        if (table[i].seg_num == 0 && table[i].hiblk > 0) table[kept++] = table[i];
+    }
+    count = kept;
+    cache_budget(budget);
+    for (threads = 1; threads <= maxthreads; threads *= 2) {
+        struct timeval start,end;
+        unsigned long blocks = 0;
+        double seconds;
+        cache_flush();
+        gettimeofday(&start,NULL);
+        for (i = 0; i < threads; i++) {
+            run[i].vcb = vcb;
+            run[i].files = table;
+            run[i].nfiles = count;
+            run[i].passes = passes;
+            run[i].first = count * i / threads;
+            run[i].blocks = 0;
+            run[i].sts = SS$_NORMAL;
+            pthread_create(&thread[i],NULL,bench_reader,&run[i]);
+        }
+        for (i = 0; i < threads; i++) {
+            pthread_join(thread[i],NULL);
+            blocks += run[i].blocks;
+            if ((run[i].sts & 1) == 0) sts = run[i].sts;
+        }
+        gettimeofday(&end,NULL);
+        seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        rate = seconds > 0 ? blocks / seconds : 0;
+        if (threads == 1) onerate = rate;
+        printf("THREADS %u: %lu blocks of %u files in %.3fs (%.0f blocks/s)",
+               threads,blocks,count,seconds,rate);
+        if (onerate > 0) printf(" - speedup %.2f",rate / onerate);
+        printf("\n");
+        if ((sts & 1) == 0) {
+            printf("Read failed %d\n",sts);
+            break;
+        }
+    }
+    free(table);
+    dismount(vcb);
+    return (sts & 1) == 0;
+}
+
+#else
+
+int bench_threads(int argc,char *argv[])
+{
+    printf("odsbench threads needs a build with -DCACHE_THREADS\n");
+    return 1;
+}
+
+#endif
+
+
+int main(int argc,char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1],"checksum") == 0) return bench_checksum(argc,argv);
+    if (argc > 1 && strcmp(argv[1],"threads") == 0) return bench_threads(argc,argv);
+    return bench_usage();
+}
@@ -28,9 +28,47 @@
             phyio_write() will write a number of bytes out to a 512 byte block
                           address on a device.
 
+        Optionally a system may also map a device image into memory:-
+            phyio_map()   to map the whole device read only. Systems which
+                          can't do this just return SS$_NOTINSTALL.
+            phyio_mapaddr() returns the address of a run of blocks within
+                          the mapping, or NULL if the device isn't mapped.
+            phyio_unmap() to release a mapping at dismount time.
+
+        and must be able to wait for writes to reach the device:-
+            phyio_sync()  returns once everything written to a device is
+                          on stable storage. Systems whose writes already
+                          go straight to the device return SS$_NORMAL.
+
+        and may start reading blocks which will be wanted soon:-
+            phyio_prefetch() queues an asynchronous read of a run of blocks
+                          without waiting for it. Systems without such a
+                          facility simply return SS$_NORMAL.
+
+        and may bypass the system's own buffer cache:-
+            phyio_direct() switches a device in or out of direct (unbuffered)
+                          mode. Buffers aligned to PHYIO_ALIGN avoid a copy
+                          through a bounce buffer. Systems without it return
+                          SS$_NOTINSTALL.
+
+        and may keep the writes to a device in a delta file beside it:-
+            phyio_overlay() with OVERLAY_OPEN starts (or resumes) an overlay,
+                          after which writes go to the delta and reads look
+                          there first. OVERLAY_CLOSE puts the delta aside for
+                          later, when OVERLAY_COMMIT copies it into the device
+                          or OVERLAY_DISCARD throws it away. A commit with no
+                          delta returns SS$_NOSUCHFILE. Systems without
+                          it return SS$_NOTINSTALL.
+
 */
 
 #define PHYIO_READONLY 1
+#define PHYIO_ALIGN 4096        /* Buffer alignment for direct transfers */
+
+#define OVERLAY_CLOSE 0         /* phyio_overlay() modes... */
+#define OVERLAY_OPEN 1
+#define OVERLAY_COMMIT 2
+#define OVERLAY_DISCARD 3
 
 struct phyio_info {
     unsigned status;
@@ -42,3 +80,10 @@ void phyio_show(void);
 unsigned phyio_init(int devlen,char *devnam,unsigned *handle,struct phyio_info *info);
 unsigned phyio_read(unsigned handle,unsigned block,unsigned length,char *buffer);
 unsigned phyio_write(unsigned handle,unsigned block,unsigned length,char *buffer);
+unsigned phyio_map(unsigned handle);
+char *phyio_mapaddr(unsigned handle,unsigned block,unsigned length);
+void phyio_unmap(unsigned handle);
+unsigned phyio_sync(unsigned handle);
+unsigned phyio_prefetch(unsigned handle,unsigned block,unsigned length);
+unsigned phyio_direct(unsigned handle,int enable);
+unsigned phyio_overlay(unsigned handle,char *devnam,int mode);
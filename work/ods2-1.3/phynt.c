@@ -648,3 +648,54 @@ unsigned phyio_write(unsigned chan,unsigned block,unsigned length,char *buffer)
     }
     return sts;
 }
+
+
+/* Device images are not memory mapped on this system... */
+
+unsigned phyio_map(unsigned handle)
+{
+    return SS$_NOTINSTALL;
+}
+
+
+char *phyio_mapaddr(unsigned handle,unsigned block,unsigned length)
+{
+    return NULL;
+}
+
+
+void phyio_unmap(unsigned handle)
+{
+}
+
+
+/* Sectors are written straight to the device by phy_putsect()... */
+
+unsigned phyio_sync(unsigned handle)
+{
+    return SS$_NORMAL;
+}
+
+
+/* No asynchronous read ahead on this system... */
+
+unsigned phyio_prefetch(unsigned handle,unsigned block,unsigned length)
+{
+    return SS$_NORMAL;
+}
+
+
+/* No unbuffered transfers on this system... */
+
+unsigned phyio_direct(unsigned handle,int enable)
+{
+    return enable ? SS$_NOTINSTALL : SS$_NORMAL;
+}
+
+
+/* No delta files for overlays here... */
+
+unsigned phyio_overlay(unsigned handle,char *devnam,int mode)
+{
+    return mode == OVERLAY_CLOSE ? SS$_NORMAL : SS$_NOTINSTALL;
+}
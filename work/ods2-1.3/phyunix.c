@@ -12,12 +12,67 @@
 
 /*
 	If the user mounts  cd0   we open up /dev/cd0 for access.
+
+	Transfers use pread()/pwrite() with 64 bit file offsets so that
+	each transfer is a single system call and volumes larger than 4GB
+	can be addressed. Compile with NO_PREAD for systems which lack the
+	positional calls - lseek() is then used before each transfer.
+	Short transfers are counted and the remainder retried up to
+	RETRY_LIMIT times before a parity error is reported. A read which
+	finds the end of the device fails at once with SS$_ILLBLKNUM.
+
+	MOUNT/MAP asks for a read only volume to be mapped into memory
+	with mmap() so that file chunks can point straight at the image
+	rather than being read into a buffer.
+
+	phyio_prefetch() hands read ahead to the kernel with posix_fadvise()
+	(or madvise() for a mapped device) so that many reads can be in
+	flight while we are busy with earlier blocks. Compile with
+	NO_FADVISE where these calls are missing.
+
+	MOUNT/DIRECT switches a device to O_DIRECT so that transfers bypass
+	the system buffer cache. Such transfers must start and end on device
+	block boundaries and use an aligned buffer, so anything which doesn't
+	(the home block probe and index file header reads for instance) is
+	moved through an aligned bounce buffer instead.
+
+	MOUNT/OVERLAY never writes the device. Writes go to a sparse delta
+	file beside it, DEVNAM.cow, at the same offsets as in the device, and
+	a bitmap of the blocks held there is kept in memory. Reads take those
+	blocks from the delta. When the overlay is closed the bitmap is saved
+	after the last device block of the delta, so the overlay can be
+	resumed, committed into the device or discarded later. The saved
+	bitmap is spoilt while an overlay is open: a delta left by a crash
+	can't be resumed or committed, only discarded. A commit opens the
+	delta without spoiling it, so one which fails part way can simply
+	be tried again.
+
+	The tables of mapped, direct and overlaid devices and the bounce
+	buffer are shared by every context. When built with CACHE_THREADS
+	the entry points here hold a lock of their own while using them, so
+	transfers from different threads are made one at a time - except
+	plain reads, which pread() lets overlap, so they are made after
+	the lock is dropped. Nothing in this module calls out while holding
+	it.
 */
 
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE             /* For O_DIRECT with glibc */
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef CACHE_THREADS
+#include <pthread.h>
+#endif
 
 #include "phyio.h"
 #include "ssdef.h"
@@ -32,25 +87,181 @@
 #endif
 #endif
 
+#define RETRY_LIMIT 8           /* Retries for a short transfer */
+#define MAP_MAX 16              /* Devices which may be mapped */
+#define DIRECT_MAX 16           /* Devices which may use direct I/O */
+#define OVERLAY_MAX 16          /* Devices which may have an overlay */
+#define OVERLAY_MAGIC "ODS2COW"
+#define OVERLAY_BIT(map,block) ((map)[(block) / 8] & (1 << ((block) % 8)))
+
 unsigned init_count = 0;
 unsigned read_count = 0;
 unsigned write_count = 0;
+unsigned short_count = 0;
+unsigned retry_count = 0;
+unsigned map_count = 0;
+unsigned prefetch_count = 0;
+unsigned prefetch_blocks = 0;
+unsigned direct_count = 0;
+unsigned bounce_count = 0;
+unsigned overlay_reads = 0;
+unsigned overlay_writes = 0;
+unsigned sync_count = 0;
+
+struct PHYMAP {
+    int fd;                     /* Handle of mapped device */
+    char *base;                 /* Address of mapping */
+    off_t size;                 /* Bytes mapped */
+} phymap[MAP_MAX];
+int phymaps = 0;
+
+struct PHYDIRECT {
+    int fd;                     /* Handle of device using O_DIRECT */
+    unsigned align;             /* Transfer alignment it requires */
+} phydirect[DIRECT_MAX];
+int phydirects = 0;
+
+char *bounce_buffer = NULL;     /* Aligned buffer for direct transfers */
+unsigned bounce_size = 0;
+
+struct PHYOVERLAY {
+    int fd;                     /* Handle of overlaid device */
+    int delta;                  /* Handle of delta file */
+    unsigned blocks;            /* Blocks in device */
+    unsigned char *map;         /* Bit set for each block in delta */
+    char name[256];             /* Delta file name */
+} phyoverlay[OVERLAY_MAX];
+int phyoverlays = 0;
+
+struct OVERLAYTAIL {
+    char magic[8];              /* OVERLAY_MAGIC when bitmap is valid */
+    unsigned blocks;            /* Blocks in device */
+};                              /* Followed by the bitmap */
+
+#ifdef CACHE_THREADS
+pthread_mutex_t phylock;
+pthread_once_t phyonce = PTHREAD_ONCE_INIT;
+
+void phyio_lockinit(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&phylock,&attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+#define PHYIO_LOCK() (pthread_once(&phyonce,phyio_lockinit),pthread_mutex_lock(&phylock))
+#define PHYIO_UNLOCK() pthread_mutex_unlock(&phylock)
+#else
+#define PHYIO_LOCK()
+#define PHYIO_UNLOCK()
+#endif
 
 void phyio_show(void)
 {
+    PHYIO_LOCK();
     printf("PHYIO_SHOW Initializations: %d Reads: %d Writes: %d\n",
            init_count,read_count,write_count);
+    if (short_count != 0 || retry_count != 0)
+        printf(" - Short transfers %d Retries %d\n",short_count,retry_count);
+    if (phymaps != 0) printf(" - Mapped devices %d Mapped transfers %d\n",phymaps,map_count);
+    if (prefetch_count != 0)
+        printf(" - Prefetches %d (%d blocks)\n",prefetch_count,prefetch_blocks);
+    if (phydirects != 0)
+        printf(" - Direct devices %d Direct transfers %d Bounced %d\n",
+               phydirects,direct_count,bounce_count);
+    if (sync_count != 0) printf(" - Syncs %d\n",sync_count);
+    if (overlay_reads != 0 || overlay_writes != 0)
+        printf(" - Overlay reads %d Overlay writes %d\n",overlay_reads,overlay_writes);
+    PHYIO_UNLOCK();
+}
+
+
+/* map_open() maps a device image into memory. The mapping is private so
+   that stray updates to cached headers never reach the image... */
+
+unsigned map_open(unsigned handle)
+{
+    struct stat st;
+    void *base;
+    register int map;
+    if (phyio_mapaddr(handle,0,0) != NULL) return SS$_NORMAL;
+    if (phymaps >= MAP_MAX) return SS$_INSFMEM;
+    for (map = 0; map < phyoverlays; map++) {
+        if (phyoverlay[map].fd == handle) return SS$_NOTINSTALL;
+    }
+    if (fstat(handle,&st) < 0 || !S_ISREG(st.st_mode) || st.st_size < 512) {
+        return SS$_NOTINSTALL;
+    }
+    base = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_PRIVATE,handle,0);
+    if (base == MAP_FAILED) {
+        perror("mmap ");
+        return SS$_INSFMEM;
+    }
+    phymap[phymaps].fd = handle;
+    phymap[phymaps].base = (char *) base;
+    phymap[phymaps].size = st.st_size;
+    phymaps++;
+    return SS$_NORMAL;
+}
+
+
+unsigned phyio_map(unsigned handle)
+{
+    register unsigned sts;
+    PHYIO_LOCK();
+    sts = map_open(handle);
+    PHYIO_UNLOCK();
+    return sts;
+}
+
+
+/* phyio_mapaddr() returns the address of blocks in a device mapping... */
+
+char *phyio_mapaddr(unsigned handle,unsigned block,unsigned length)
+{
+    register int map;
+    register char *address = NULL;
+    PHYIO_LOCK();
+    for (map = 0; map < phymaps; map++) {
+        if (phymap[map].fd == handle) {
+            off_t offset = (off_t) block * 512;
+            if (offset + length <= phymap[map].size) address = phymap[map].base + offset;
+            break;
+        }
+    }
+    PHYIO_UNLOCK();
+    return address;
+}
+
+
+/* phyio_unmap() releases a device mapping... */
+
+void phyio_unmap(unsigned handle)
+{
+    register int map;
+    PHYIO_LOCK();
+    for (map = 0; map < phymaps; map++) {
+        if (phymap[map].fd == handle) {
+            munmap(phymap[map].base,phymap[map].size);
+            phymap[map] = phymap[--phymaps];
+            break;
+        }
+    }
+    PHYIO_UNLOCK();
 }
 
 
 unsigned phyio_init(int devlen,char *devnam,unsigned *handle,struct phyio_info *info)
 {
     int vmsfd;
-    char *cp,devbuf[200];
+    char *cp,devbuf[1024];
     init_count++;
     info->status = 0;           /* We don't know anything about this device! */
     info->sectors = 0;
     info->sectorsize = 0;
+    if (strlen(devnam) + sizeof(DEV_PREFIX) > sizeof(devbuf)) return SS$_NOSUCHDEV;
     sprintf(devbuf,DEV_PREFIX,devnam);
     cp = strchr(devbuf,':');
     if (cp != NULL) *cp = '\0';
@@ -64,29 +275,425 @@ unsigned phyio_init(int devlen,char *devnam,unsigned *handle,struct phyio_info *
 
 unsigned phyio_close(unsigned handle)
 {
+    phyio_direct(handle,0);
     close(handle);
     return SS$_NORMAL;
 }
 
 
+/* phyio_move() moves length bytes at a byte offset in one positional
+   call, continuing after short transfers until all are done... */
+
+unsigned phyio_move(unsigned handle,off_t offset,unsigned length,
+                    char *buffer,int writeflag)
+{
+    register unsigned done = 0;
+    register int retries = 0;
+    while (done < length) {
+        register ssize_t res;
+#ifdef NO_PREAD
+        if (lseek(handle,offset + done,SEEK_SET) < 0) {
+            perror("lseek ");
+            return SS$_PARITY;
+        }
+        if (writeflag) {
+            res = write(handle,buffer + done,length - done);
+        } else {
+            res = read(handle,buffer + done,length - done);
+        }
+#else
+        if (writeflag) {
+            res = pwrite(handle,buffer + done,length - done,offset + done);
+        } else {
+            res = pread(handle,buffer + done,length - done,offset + done);
+        }
+#endif
+        if (res > 0) {
+            done += res;
+            if (done < length) {
+                PHYIO_LOCK();
+                short_count++;
+                PHYIO_UNLOCK();
+            }
+        } else {
+            if (res == 0 && !writeflag) return SS$_ILLBLKNUM;  /* End of device */
+            if (res < 0 && errno != EINTR && errno != EAGAIN) {
+                perror(writeflag ? "write " : "read ");
+                return SS$_PARITY;
+            }
+            PHYIO_LOCK();
+            retry_count++;
+            PHYIO_UNLOCK();
+            if (++retries > RETRY_LIMIT) {
+                printf("%s failed at block %u (%u of %u bytes)\n",
+                       writeflag ? "write" : "read",(unsigned) (offset / 512),done,length);
+                return SS$_PARITY;
+            }
+        }
+    }
+    return SS$_NORMAL;
+}
+
+
+/* phyio_bounce() does a direct transfer through the aligned bounce buffer,
+   reading in the partial device blocks around an unaligned write... */
+
+unsigned phyio_bounce(struct PHYDIRECT *direct,off_t offset,unsigned length,
+                      char *buffer,int writeflag)
+{
+    register unsigned sts;
+    register unsigned skip = (unsigned) (offset % direct->align);
+    register unsigned size = (skip + length + direct->align - 1) / direct->align * direct->align;
+    if (size > bounce_size) {
+        void *newbuf;
+        if (posix_memalign(&newbuf,PHYIO_ALIGN,size) != 0) return SS$_INSFMEM;
+        free(bounce_buffer);
+        bounce_buffer = (char *) newbuf;
+        bounce_size = size;
+    }
+    bounce_count++;
+    if (!writeflag || skip != 0 || size != length) {
+        sts = phyio_move(direct->fd,offset - skip,size,bounce_buffer,0);
+        if (!(sts & 1)) return sts;
+    }
+    if (writeflag) {
+        memcpy(bounce_buffer + skip,buffer,length);
+        return phyio_move(direct->fd,offset - skip,size,bounce_buffer,1);
+    }
+    memcpy(buffer,bounce_buffer + skip,length);
+    return SS$_NORMAL;
+}
+
+
+/* phyio_bounced() returns the direct device entry if a transfer has to
+   go through the bounce buffer, else NULL... */
+
+struct PHYDIRECT *phyio_bounced(unsigned handle,off_t offset,unsigned length,char *buffer)
+{
+    register int direct;
+    for (direct = 0; direct < phydirects; direct++) {
+        if (phydirect[direct].fd == handle) {
+            register unsigned align = phydirect[direct].align;
+            if ((uintptr_t) buffer % align != 0 ||
+                offset % align != 0 || length % align != 0) {
+                return &phydirect[direct];
+            }
+            direct_count++;
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/* phyio_transfer() moves length bytes at a 512 byte block address, going
+   through the bounce buffer if a direct device can't take it as is... */
+
+unsigned phyio_transfer(unsigned handle,unsigned block,unsigned length,
+                        char *buffer,int writeflag)
+{
+    off_t offset = (off_t) block * 512;
+    register struct PHYDIRECT *direct = phyio_bounced(handle,offset,length,buffer);
+    if (direct != NULL) return phyio_bounce(direct,offset,length,buffer,writeflag);
+    return phyio_move(handle,offset,length,buffer,writeflag);
+}
+
+
+/* direct_set() turns O_DIRECT on or off for a device. When turning it
+   on we find the transfer size the device will accept by reading block 0
+   into an aligned buffer... */
+
+unsigned direct_set(unsigned handle,int enable)
+{
+    register int direct;
+    for (direct = 0; direct < phydirects; direct++) {
+        if (phydirect[direct].fd == handle) break;
+    }
+    if (!enable) {
+        if (direct < phydirects) {
+#ifdef O_DIRECT
+            int flags = fcntl(handle,F_GETFL);
+            if (flags >= 0) fcntl(handle,F_SETFL,flags & ~O_DIRECT);
+#endif
+            phydirect[direct] = phydirect[--phydirects];
+        }
+        return SS$_NORMAL;
+    } else {
+#ifdef O_DIRECT
+        register unsigned align;
+        void *probe;
+        int flags;
+        if (direct < phydirects) return SS$_NORMAL;
+        if (phydirects >= DIRECT_MAX) return SS$_INSFMEM;
+        flags = fcntl(handle,F_GETFL);
+        if (flags < 0 || fcntl(handle,F_SETFL,flags | O_DIRECT) < 0) return SS$_NOTINSTALL;
+        if (posix_memalign(&probe,PHYIO_ALIGN,PHYIO_ALIGN) != 0) {
+            fcntl(handle,F_SETFL,flags);
+            return SS$_INSFMEM;
+        }
+        for (align = 512; align <= PHYIO_ALIGN; align *= 2) {
+            if (pread(handle,probe,align,0) == (ssize_t) align) break;
+        }
+        free(probe);
+        if (align > PHYIO_ALIGN) {
+            fcntl(handle,F_SETFL,flags);
+            return SS$_NOTINSTALL;
+        }
+        phydirect[phydirects].fd = handle;
+        phydirect[phydirects].align = align;
+        phydirects++;
+        return SS$_NORMAL;
+#else
+        return SS$_NOTINSTALL;
+#endif
+    }
+}
+
+
+unsigned phyio_direct(unsigned handle,int enable)
+{
+    register unsigned sts;
+    PHYIO_LOCK();
+    sts = direct_set(handle,enable);
+    PHYIO_UNLOCK();
+    return sts;
+}
+
+
+/* overlay_transfer() moves blocks of an overlaid device. Writes go to the
+   delta, and reads are split into runs taken from the delta or the
+   device... */
+
+unsigned overlay_transfer(struct PHYOVERLAY *overlay,unsigned block,unsigned length,
+                          char *buffer,int writeflag)
+{
+    register unsigned sts = SS$_NORMAL;
+    register unsigned blocks = (length + 511) / 512;
+    if (writeflag) {
+        if (length % 512 != 0 || block + blocks > overlay->blocks) return SS$_BADPARAM;
+        overlay_writes++;
+        sts = phyio_move(overlay->delta,(off_t) block * 512,length,buffer,1);
+        if (sts & 1) {
+            while (blocks-- > 0) {
+                overlay->map[block / 8] |= 1 << (block % 8);
+                block++;
+            }
+        }
+        return sts;
+    }
+    while (length > 0) {
+        register unsigned run = 1;
+        register unsigned runlen;
+        register int held = 0;
+        if (block < overlay->blocks) {
+            held = OVERLAY_BIT(overlay->map,block) != 0;
+            while (run < blocks && block + run < overlay->blocks &&
+                   (OVERLAY_BIT(overlay->map,block + run) != 0) == held) run++;
+        } else {
+            run = blocks;
+        }
+        runlen = run * 512;
+        if (runlen > length) runlen = length;
+        if (held) {
+            overlay_reads++;
+            sts = phyio_move(overlay->delta,(off_t) block * 512,runlen,buffer,0);
+        } else {
+            sts = phyio_transfer(overlay->fd,block,runlen,buffer,0);
+        }
+        if (!(sts & 1)) break;
+        block += run;
+        blocks -= run;
+        buffer += runlen;
+        length -= runlen;
+    }
+    return sts;
+}
+
+
+/* overlay_name() makes the delta file name for a device */
+
+void overlay_name(char *devnam,char *name,unsigned size)
+{
+    register char *cp;
+    strncpy(name,devnam,size - 5);
+    name[size - 5] = '\0';
+    cp = strchr(name,':');
+    if (cp == NULL) cp = name + strlen(name);
+    strcpy(cp,".cow");
+}
+
+
+/* overlay_open() starts an overlay for a device, picking up the bitmap of
+   any delta put aside before. Opening an overlay (OVERLAY_OPEN) creates
+   the delta if need be and spoils its saved bitmap; a commit needs an
+   existing delta and leaves it as it is... */
+
+unsigned overlay_open(unsigned handle,char *devnam,int mode,struct PHYOVERLAY **retoverlay)
+{
+    register struct PHYOVERLAY *overlay;
+    register unsigned mapsize;
+    struct stat st;
+    off_t size;
+    if (phyoverlays >= OVERLAY_MAX) return SS$_INSFMEM;
+    overlay = &phyoverlay[phyoverlays];
+    size = lseek(handle,0,SEEK_END);
+    if (size < 512) return SS$_NOTINSTALL;
+    overlay->fd = handle;
+    overlay->blocks = size / 512;
+    mapsize = (overlay->blocks + 7) / 8;
+    overlay->map = (unsigned char *) calloc(mapsize,1);
+    if (overlay->map == NULL) return SS$_INSFMEM;
+    overlay_name(devnam,overlay->name,sizeof(overlay->name));
+    overlay->delta = open(overlay->name,mode == OVERLAY_OPEN ? O_RDWR | O_CREAT : O_RDWR,0644);
+    if (overlay->delta < 0 || fstat(overlay->delta,&st) < 0 ||
+        (st.st_size == 0 && mode != OVERLAY_OPEN)) {
+        if (overlay->delta >= 0) close(overlay->delta);
+        free(overlay->map);
+        return SS$_NOSUCHFILE;
+    }
+    if (st.st_size > 0) {
+        struct OVERLAYTAIL tail;
+        off_t offset = (off_t) overlay->blocks * 512;
+        if (phyio_move(overlay->delta,offset,sizeof(tail),(char *) &tail,0) != SS$_NORMAL ||
+            memcmp(tail.magic,OVERLAY_MAGIC,sizeof(tail.magic)) != 0 ||
+            tail.blocks != overlay->blocks ||
+            phyio_move(overlay->delta,offset + sizeof(tail),mapsize,
+                       (char *) overlay->map,0) != SS$_NORMAL) {
+            close(overlay->delta);
+            free(overlay->map);
+            return SS$_DATACHECK;
+        }
+        if (mode == OVERLAY_OPEN) {
+            memset(tail.magic,0,sizeof(tail.magic));
+            phyio_move(overlay->delta,offset,sizeof(tail.magic),tail.magic,1);
+        }
+    }
+    phyoverlays++;
+    *retoverlay = overlay;
+    return SS$_NORMAL;
+}
+
+
+/* overlay_save() writes the bitmap and a valid tail after the last
+   device block of the delta... */
+
+unsigned overlay_save(struct PHYOVERLAY *overlay)
+{
+    register unsigned sts;
+    struct OVERLAYTAIL tail;
+    off_t offset = (off_t) overlay->blocks * 512;
+    memcpy(tail.magic,OVERLAY_MAGIC,sizeof(tail.magic));
+    tail.blocks = overlay->blocks;
+    sts = phyio_move(overlay->delta,offset + sizeof(tail),(overlay->blocks + 7) / 8,
+                     (char *) overlay->map,1);
+    if (sts & 1) sts = phyio_move(overlay->delta,offset,sizeof(tail),(char *) &tail,1);
+    return sts;
+}
+
+
+/* overlay_action() opens, closes, commits or discards a device overlay */
+
+unsigned overlay_action(unsigned handle,char *devnam,int mode)
+{
+    register unsigned sts = SS$_NORMAL;
+    register int ov;
+    struct PHYOVERLAY *overlay = NULL;
+    for (ov = 0; ov < phyoverlays; ov++) {
+        if (phyoverlay[ov].fd == handle) {
+            overlay = &phyoverlay[ov];
+            break;
+        }
+    }
+    if (overlay == NULL) {
+        if (mode == OVERLAY_CLOSE) return SS$_NORMAL;
+        if (mode == OVERLAY_DISCARD) {
+            char name[256];
+            overlay_name(devnam,name,sizeof(name));
+            remove(name);
+            return SS$_NORMAL;
+        }
+        sts = overlay_open(handle,devnam,mode,&overlay);
+        if (!(sts & 1)) return sts;
+    }
+    if (mode == OVERLAY_OPEN) return SS$_NORMAL;
+    if (mode == OVERLAY_CLOSE) sts = overlay_save(overlay);
+    if (mode == OVERLAY_COMMIT) {
+        register unsigned block = 0;
+        char *buffer = (char *) malloc(64 * 512);
+        if (buffer == NULL) sts = SS$_INSFMEM;
+        while (block < overlay->blocks && (sts & 1)) {
+            register unsigned run = 0;
+            if (!OVERLAY_BIT(overlay->map,block)) {
+                block++;
+                continue;
+            }
+            while (run < 64 && block + run < overlay->blocks &&
+                   OVERLAY_BIT(overlay->map,block + run)) run++;
+            sts = phyio_move(overlay->delta,(off_t) block * 512,run * 512,buffer,0);
+            if (sts & 1) sts = phyio_transfer(handle,block,run * 512,buffer,1);
+            if (!(sts & 1)) break;
+            block += run;
+        }
+        if (buffer != NULL) free(buffer);
+        if (!(sts & 1)) overlay_save(overlay);  /* Keep the delta for a retry */
+    }
+    close(overlay->delta);
+    if (mode == OVERLAY_DISCARD || (mode == OVERLAY_COMMIT && (sts & 1))) remove(overlay->name);
+    free(overlay->map);
+    *overlay = phyoverlay[--phyoverlays];
+    return sts;
+}
+
+
+unsigned phyio_overlay(unsigned handle,char *devnam,int mode)
+{
+    register unsigned sts;
+    PHYIO_LOCK();
+    sts = overlay_action(handle,devnam,mode);
+    PHYIO_UNLOCK();
+    return sts;
+}
+
+
 unsigned phyio_read(unsigned handle,unsigned block,unsigned length,char *buffer)
 {
-    int res;
 #ifdef DEBUG
     printf("Phyio read block: %d into %x (%d bytes)\n",block,buffer,length);
 #endif
+    register unsigned sts;
+    register int ov;
+    PHYIO_LOCK();
     read_count++;
-    if ((res = lseek(handle,block*512,0)) < 0) {
-        perror("lseek ");
-	printf("lseek failed %d\n",res);
-        return SS$_PARITY;
+    if (phymaps != 0) {
+        register char *address = phyio_mapaddr(handle,block,length);
+        if (address != NULL) {
+            map_count++;
+            memcpy(buffer,address,length);
+            PHYIO_UNLOCK();
+            return SS$_NORMAL;
+        }
     }
-    if ((res = read(handle,buffer,length)) != length) {
-        perror("read ");
-	printf("read failed %d\n",res);
-        return SS$_PARITY;
+    for (ov = 0; ov < phyoverlays; ov++) {
+        if (phyoverlay[ov].fd == handle) break;
     }
-    return SS$_NORMAL;
+    if (ov < phyoverlays) {
+        sts = overlay_transfer(&phyoverlay[ov],block,length,buffer,0);
+    } else {
+        off_t offset = (off_t) block * 512;
+        register struct PHYDIRECT *direct = phyio_bounced(handle,offset,length,buffer);
+        if (direct != NULL) {
+            sts = phyio_bounce(direct,offset,length,buffer,0);
+        } else {
+#if defined(CACHE_THREADS) && !defined(NO_PREAD)
+            PHYIO_UNLOCK();     /* No shared file position to protect */
+            return phyio_move(handle,offset,length,buffer,0);
+#else
+            sts = phyio_move(handle,offset,length,buffer,0);
+#endif
+        }
+    }
+    PHYIO_UNLOCK();
+    return sts;
 }
 
 
@@ -95,8 +702,75 @@ unsigned phyio_write(unsigned handle,unsigned block,unsigned length,char *buffer
 #ifdef DEBUG
     printf("Phyio write block: %d from %x (%d bytes)\n",block,buffer,length);
 #endif
+    register unsigned sts;
+    register int ov;
+    PHYIO_LOCK();
     write_count++;
-    if (lseek(handle,block*512,0) < 0) return SS$_PARITY;
-    if (write(handle,buffer,length) != length) return SS$_PARITY;
+    for (ov = 0; ov < phyoverlays; ov++) {
+        if (phyoverlay[ov].fd == handle) break;
+    }
+    if (ov < phyoverlays) {
+        sts = overlay_transfer(&phyoverlay[ov],block,length,buffer,1);
+    } else {
+        sts = phyio_transfer(handle,block,length,buffer,1);
+    }
+    PHYIO_UNLOCK();
+    return sts;
+}
+
+
+/* phyio_sync() waits for the writes to a device to reach the disk. An
+   overlaid device is never written, so its delta is synced instead */
+
+unsigned phyio_sync(unsigned handle)
+{
+    register unsigned sts = SS$_NORMAL;
+    register int ov;
+    PHYIO_LOCK();
+    sync_count++;
+    for (ov = 0; ov < phyoverlays; ov++) {
+        if (phyoverlay[ov].fd == handle) {
+            handle = phyoverlay[ov].delta;
+            break;
+        }
+    }
+    if (fsync(handle) < 0) {
+        perror("fsync ");
+        sts = SS$_PARITY;
+    }
+    PHYIO_UNLOCK();
+    return sts;
+}
+
+
+/* phyio_prefetch() starts reading blocks which we expect to want soon.
+   Direct devices are skipped as the read ahead would land in the very
+   cache they bypass... */
+
+unsigned phyio_prefetch(unsigned handle,unsigned block,unsigned length)
+{
+#ifndef NO_FADVISE
+    register char *address;
+    register int direct;
+    PHYIO_LOCK();
+    for (direct = 0; direct < phydirects; direct++) {
+        if (phydirect[direct].fd == handle) break;
+    }
+    if (direct < phydirects) {
+        PHYIO_UNLOCK();
+        return SS$_NORMAL;
+    }
+    prefetch_count++;
+    prefetch_blocks += length / 512;
+    address = phyio_mapaddr(handle,block,length);
+    if (address != NULL) {
+        long pagesize = sysconf(_SC_PAGESIZE);
+        long offset = (long) ((uintptr_t) address % pagesize);
+        madvise(address - offset,length + offset,MADV_WILLNEED);
+    } else {
+        posix_fadvise(handle,(off_t) block * 512,length,POSIX_FADV_WILLNEED);
+    }
+    PHYIO_UNLOCK();
+#endif
     return SS$_NORMAL;
 }
@@ -151,3 +151,54 @@ unsigned phyio_write(unsigned handle,unsigned block,unsigned length,char *buffer
     printf("Phyio write block: %d from %x (%d bytes)\n",block,buffer,length);
     return sys$qiow(1,handle,IO$_WRITELBLK,NULL,0,0,buffer,length,block,0,0,0);
 }
+
+
+/* Device images are not memory mapped on this system... */
+
+unsigned phyio_map(unsigned handle)
+{
+    return SS$_NOTINSTALL;
+}
+
+
+char *phyio_mapaddr(unsigned handle,unsigned block,unsigned length)
+{
+    return NULL;
+}
+
+
+void phyio_unmap(unsigned handle)
+{
+}
+
+
+/* Logical block QIOs complete when the device has the data... */
+
+unsigned phyio_sync(unsigned handle)
+{
+    return SS$_NORMAL;
+}
+
+
+/* No asynchronous read ahead on this system... */
+
+unsigned phyio_prefetch(unsigned handle,unsigned block,unsigned length)
+{
+    return SS$_NORMAL;
+}
+
+
+/* Logical block QIOs don't go through a buffer cache anyway... */
+
+unsigned phyio_direct(unsigned handle,int enable)
+{
+    return SS$_NORMAL;
+}
+
+
+/* No delta files for overlays here... */
+
+unsigned phyio_overlay(unsigned handle,char *devnam,int mode)
+{
+    return mode == OVERLAY_CLOSE ? SS$_NORMAL : SS$_NOTINSTALL;
+}
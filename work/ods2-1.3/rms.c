@@ -125,15 +125,61 @@ unsigned name_delim(char *str,int len,int size[5])
 }
 
 
-/* Function to compare directory cache names - directory cache NOT IN USE */
+/* The directory cache remembers the file id of every directory path
+   that a search has been down, keyed on the path between the brackets
+   (A.B.C), so that do_parse() can start from the longest cached prefix
+   rather than looking up each level again. Entries are volume objects
+   like any other, so the cache budget trims the unused ones, and a volume
+   holds at most DIRCACHE_MAX of them. Deleting a directory forgets the
+   lot, as any path through it may now be wrong... */
+
+#define DIRCACHE_MAX 512        /* Directory cache entries per volume */
+#define DIRLEN_MASK 1023        /* Hash value bits holding path length */
+
+int dircache_hits = 0;
+int dircache_misses = 0;
+int dircache_adds = 0;
+int dircache_purges = 0;
+
+struct DIRKEY {
+    struct VCB *vcb;            /* Volume for a new entry */
+    char *dirnam;               /* Directory path */
+    int dirlen;                 /* Length of path */
+    struct fiddef *dirid;       /* File ID for a new entry */
+};
+
+
+/* rms_show() - to print directory cache statistics */
+
+void rms_show(void)
+{
+    printf("RMS_SHOW Directory cache Hits: %d Misses: %d Adds: %d Purges: %d\n",
+           dircache_hits,dircache_misses,dircache_adds,dircache_purges);
+}
 
-int dircmp(unsigned keylen,void *key,void *node)
+
+/* dirhash() - hash a directory path regardless of case. The length goes
+   in the low bits so that equal hash values mean equal lengths... */
+
+unsigned dirhash(char *dirnam,int dirlen)
 {
+    register int len = dirlen;
+    register unsigned hash = 0;
+    while (len-- > 0) hash = hash * 31 + toupper(*dirnam++);
+    return (hash << 10) | (dirlen & DIRLEN_MASK);
+}
+
+
+/* Function to compare directory cache names... */
+
+int dircmp(unsigned hashval,void *key,void *node)
+{
+    register struct DIRKEY *dirkey = (struct DIRKEY *) key;
     register struct DIRCACHE *dirnode = (struct DIRCACHE *) node;
-    register int cmp = keylen - dirnode->dirlen;
+    register int cmp = dirkey->dirlen - dirnode->dirlen;
     if (cmp == 0) {
-        register int len = keylen;
-        register char *keynam = (char *) key;
+        register int len = dirkey->dirlen;
+        register char *keynam = dirkey->dirnam;
         register char *dirnam = dirnode->dirnam;
         while (len-- > 0) {
             cmp = toupper(*keynam++) - toupper(*dirnam++);
@@ -144,7 +190,73 @@ int dircmp(unsigned keylen,void *key,void *node)
 }
 
 
-/* Routine to find directory name in cache... NOT CURRENTLY IN USE!!! */
+/* Object manager for directory cache entries - keep the volume count */
+
+void *dircache_manager(struct CACHE *cacheobj,int flushonly)
+{
+    if (flushonly) return NULL;
+    ((struct DIRCACHE *) cacheobj)->vcb->dircount--;
+    return cacheobj;
+}
+
+
+void *dircache_create(unsigned hashval,void *key,unsigned *retsts)
+{
+    register struct DIRKEY *dirkey = (struct DIRKEY *) key;
+    register struct DIRCACHE *dir;
+    dir = (struct DIRCACHE *) cache_alloc(dirkey->vcb->arena,5,
+                                          sizeof(struct DIRCACHE) + dirkey->dirlen);
+    if (dir == NULL) {
+        *retsts = SS$_INSFMEM;
+    } else {
+        dir->cache.objmanager = dircache_manager;
+        dir->vcb = dirkey->vcb;
+        dir->dirlen = dirkey->dirlen;
+        memcpy(&dir->dirid,dirkey->dirid,sizeof(struct fiddef));
+        memcpy(dir->dirnam,dirkey->dirnam,dirkey->dirlen);
+        dir->vcb->dircount++;
+        CACHE_COUNT(dircache_adds);
+    }
+    return dir;
+}
+
+
+/* dircache_purge() - forget every directory of a volume */
+
+void dircache_purge(struct VCB *vcb)
+{
+    if (vcb->dircache != NULL) {
+        cache_remove((struct CACHE *) vcb->dircache);
+        CACHE_COUNT(dircache_purges);
+    }
+}
+
+
+/* dircache_add() - remember the file id of a directory path */
+
+void dircache_add(struct VCB *vcb,char *dirnam,int dirlen,struct fiddef *dirid)
+{
+    if (dirlen > 0 && dirlen <= DIRLEN_MASK) {
+        struct DIRKEY dirkey;
+        unsigned sts;
+        register struct DIRCACHE *dir;
+        if (vcb->dircount >= DIRCACHE_MAX) dircache_purge(vcb);
+        dirkey.vcb = vcb;
+        dirkey.dirnam = dirnam;
+        dirkey.dirlen = dirlen;
+        dirkey.dirid = dirid;
+        dir = cache_find((void *) &vcb->dircache,dirhash(dirnam,dirlen),&dirkey,&sts,
+                         dircmp,dircache_create);
+        if (dir != NULL) {
+            memcpy(&dir->dirid,dirid,sizeof(struct fiddef));
+            cache_untouch(&dir->cache,1);
+        }
+    }
+}
+
+
+/* Routine to find directory name in cache. A hit also puts the path back
+   the way the directories spell it, as if it had been searched for... */
 
 unsigned dircache(struct VCB *vcb,char *dirnam,int dirlen,struct fiddef *dirid)
 {
@@ -156,12 +268,23 @@ unsigned dircache(struct VCB *vcb,char *dirnam,int dirlen,struct fiddef *dirid)
         dirid->fid$b_nmx = 0;
         return 1;
     } else {
+        struct DIRKEY dirkey;
         unsigned sts;
-        dir = cache_find((void *) &vcb->dircache,dirlen,dirnam,&sts,dircmp,NULL);
+        if (dirlen > DIRLEN_MASK) return 0;
+        dirkey.vcb = vcb;
+        dirkey.dirnam = dirnam;
+        dirkey.dirlen = dirlen;
+        dirkey.dirid = dirid;
+        dir = cache_find((void *) &vcb->dircache,dirhash(dirnam,dirlen),&dirkey,&sts,
+                         dircmp,NULL);
         if (dir != NULL) {
             memcpy(dirid,&dir->dirid,sizeof(struct fiddef));
+            memcpy(dirnam,dir->dirnam,dirlen);
+            cache_untouch(&dir->cache,1);
+            CACHE_COUNT(dircache_hits);
             return 1;
         }
+        CACHE_COUNT(dircache_misses);
         return 0;
     }
 }
@@ -212,6 +335,7 @@ struct WCCFILE {
     struct VCB *wcf_vcb;
     struct FCB *wcf_fcb;
     int wcf_status;
+    int wcf_dirpos;             /* Where directory path starts in result */
     struct fiddef wcf_fid;
     char wcf_result[MAX_FILELEN];
     struct WCCDIR wcf_wcd;      /* Must be last..... (dynamic length). */
@@ -298,7 +422,11 @@ unsigned do_search(struct FAB *fab,struct WCCFILE *wccfile)
                     wcc == &wccfile->wcf_wcd ||
                     memcmp(wcc->wcd_sernam,"000000.",7) == 0) {
                     memcpy(&wcc->wcd_prev->wcd_dirid,&fibblk.fib$w_fid_num,sizeof(struct fiddef));
-                    if (wcc->wcd_next) wccfile->wcf_result[wcc->wcd_prelen - 1] = '.';
+                    if (wcc->wcd_prelen > wccfile->wcf_dirpos)
+                        wccfile->wcf_result[wcc->wcd_prelen - 1] = '.';
+                    dircache_add(wccfile->wcf_vcb,wccfile->wcf_result + wccfile->wcf_dirpos,
+                                 wcc->wcd_prelen + wcc->wcd_reslen - 6 - wccfile->wcf_dirpos,
+                                 &wcc->wcd_prev->wcd_dirid);
                     wcc->wcd_prev->wcd_prelen = wcc->wcd_prelen + wcc->wcd_reslen - 5;
                     wcc = wcc->wcd_prev;        /* go down one level */
                     if (wcc->wcd_prev == NULL) wccfile->wcf_result[wcc->wcd_prelen - 1] = ']';
@@ -347,8 +475,12 @@ unsigned do_search(struct FAB *fab,struct WCCFILE *wccfile)
                     if (wcc->wcd_next != NULL) wcc->wcd_next->wcd_prev = wcc->wcd_prev;
                     if (wcc->wcd_prev != NULL) wcc->wcd_prev->wcd_next = wcc->wcd_next;
                     wcc = wcc->wcd_next;
-                    memcpy(wccfile->wcf_result + wcc->wcd_prelen + wcc->wcd_reslen - 6,".DIR;1",6);
                     free(savwcc);
+                    if (wcc == NULL) {
+                        sts = RMS$_NMF;
+                        break;  /* top directory came from the cache */
+                    }
+                    memcpy(wccfile->wcf_result + wcc->wcd_prelen + wcc->wcd_reslen - 6,".DIR;1",6);
                 } else {
                     if ((wccfile->wcf_status & STATUS_RECURSE) && wcc->wcd_prev == NULL) {
                         struct WCCDIR *newwcc;
@@ -415,16 +547,93 @@ unsigned sys_search(struct FAB *fab)
 
 
 
-#define DEFAULT_SIZE 120
-char default_buffer[DEFAULT_SIZE];
-char *default_name = "DKA200:[000000].;";
-int default_size[] = {7,8,0,1,1};
+/* The library context: open files and the default directory. Each
+   thread (or job) may have its own, selected with ctx_set()... */
+
+struct CONTEXT defcontext = {{NULL},"DKA200:[000000].;",{7,8,0,1,1}};
+
+#ifdef CACHE_THREADS
+#include <pthread.h>
+
+pthread_key_t ctxkey;
+pthread_once_t ctxonce = PTHREAD_ONCE_INIT;
+
+void ctx_keyinit(void)
+{
+    pthread_key_create(&ctxkey,NULL);
+}
+
+struct CONTEXT *ctx_current(void)
+{
+    register struct CONTEXT *ctx;
+    pthread_once(&ctxonce,ctx_keyinit);
+    ctx = (struct CONTEXT *) pthread_getspecific(ctxkey);
+    return ctx != NULL ? ctx : &defcontext;
+}
+
+struct CONTEXT *ctx_set(struct CONTEXT *ctx)
+{
+    register struct CONTEXT *oldctx = ctx_current();
+    pthread_setspecific(ctxkey,ctx);
+    return oldctx;
+}
+#else
+struct CONTEXT *curcontext = &defcontext;
+
+struct CONTEXT *ctx_current(void)
+{
+    return curcontext;
+}
+
+struct CONTEXT *ctx_set(struct CONTEXT *ctx)
+{
+    register struct CONTEXT *oldctx = curcontext;
+    curcontext = ctx != NULL ? ctx : &defcontext;
+    return oldctx;
+}
+#endif
+
+
+/* ctx_create() - make a new context with nothing open, starting from
+   the default directory of the current one... */
+
+struct CONTEXT *ctx_create(void)
+{
+    register struct CONTEXT *ctx = (struct CONTEXT *) malloc(sizeof(struct CONTEXT));
+    if (ctx != NULL) {
+        register int ifi_no;
+        register struct CONTEXT *curctx = ctx_current();
+        for (ifi_no = 0; ifi_no < IFI_MAX; ifi_no++) ctx->ifi_table[ifi_no] = NULL;
+        ctx->default_name = curctx->default_name;
+        memcpy(ctx->default_size,curctx->default_size,sizeof(ctx->default_size));
+        if (ctx->default_name == curctx->default_buffer) {
+            memcpy(ctx->default_buffer,curctx->default_buffer,DEFAULT_SIZE);
+            ctx->default_name = ctx->default_buffer;
+        }
+    }
+    return ctx;
+}
+
+
+/* ctx_delete() - free a context, which must not have files open */
+
+unsigned ctx_delete(struct CONTEXT *ctx)
+{
+    register int ifi_no;
+    for (ifi_no = 1; ifi_no < IFI_MAX; ifi_no++) {
+        if (ctx->ifi_table[ifi_no] != NULL) return SS$_FILELOCKED;
+    }
+    if (ctx_current() == ctx) ctx_set(NULL);
+    free(ctx);
+    return SS$_NORMAL;
+}
 
 
 /* Function to perform RMS parse.... */
 
 unsigned do_parse(struct FAB *fab,struct WCCFILE **wccret)
 {
+    struct CONTEXT *ctx = ctx_current();
     struct WCCFILE *wccfile;
     char *fna = fab->fab$l_fna;
     char *dna = fab->fab$l_dna;
@@ -461,7 +670,7 @@ memset(wccfile,0,sizeof(struct WCCFILE)+256);
 
     {
         int field,ess = MAX_FILELEN;
-        char *esa,*def = default_name;
+        char *esa,*def = ctx->default_name;
         esa = wccfile->wcf_result;
         for (field = 0; field < 5; field++) {
             char *src;
@@ -473,7 +682,7 @@ memset(wccfile,0,sizeof(struct WCCFILE)+256);
                 if (len > 0) {
                     src = dna;
                 } else {
-                    len = default_size[field];
+                    len = ctx->default_size[field];
                     src = def;
                 }
             }
@@ -481,7 +690,7 @@ memset(wccfile,0,sizeof(struct WCCFILE)+256);
             if (field == 1) {
                 int dirlen = len;
                 if (len < 3) {
-                    dirlen = len = default_size[field];
+                    dirlen = len = ctx->default_size[field];
                     src = def;
                 } else {
                     char ch1 = *(src + 1);
@@ -489,7 +698,7 @@ memset(wccfile,0,sizeof(struct WCCFILE)+256);
                     if (ch1 == '.' || (ch1 == '-' &&
                                        (ch2 == '-' || ch2 == '.' || ch2 == ']'))) {
                         char *dir = def;
-                        int count = default_size[1] - 1;
+                        int count = ctx->default_size[1] - 1;
                         len--;
                         src++;
                         while (len >= 2 && *src == '-') {
@@ -522,7 +731,7 @@ memset(wccfile,0,sizeof(struct WCCFILE)+256);
                 fna_size[field] = len;
             }
             dna += dna_size[field];
-            def += default_size[field];
+            def += ctx->default_size[field];
             if ((ess -= len) < 0) return RMS$_ESS;
             while (len-- > 0) {
                 register char ch;
@@ -585,6 +794,7 @@ memset(wccfile,0,sizeof(struct WCCFILE)+256);
         }
         /* see if we can find directory in cache... */
 
+        wccfile->wcf_dirpos = fna_size[0] + 1;
         dirsiz = dirlen;
         do {
             char *dirend = dirnam + dirsiz;
@@ -595,6 +805,17 @@ memset(wccfile,0,sizeof(struct WCCFILE)+256);
             }
         } while (1);
 
+        /* If all of it was there the search starts with the file... */
+
+        if (dirsiz > 0) {
+            if (dirsiz == dirlen) {
+                dirnam[dirlen] = ']';
+                wcc->wcd_prelen = wccfile->wcf_dirpos + dirlen + 1;
+            } else {
+                dirsiz++;       /* Skip the dot after the cached part */
+            }
+        }
+
 
         /* Create directory wcc blocks for what's left ... */
 
@@ -658,12 +879,13 @@ unsigned sys_parse(struct FAB *fab)
 unsigned sys_setddir(struct dsc_descriptor *newdir,unsigned short *oldlen,
                      struct dsc_descriptor *olddir)
 {
+    struct CONTEXT *ctx = ctx_current();
     unsigned sts = 1;
     if (oldlen != NULL) {
-        int retlen = default_size[0] + default_size[1];
+        int retlen = ctx->default_size[0] + ctx->default_size[1];
         if (retlen > olddir->dsc_w_length) retlen = olddir->dsc_w_length;
         *oldlen = retlen;
-        memcpy(olddir->dsc_a_pointer,default_name,retlen);
+        memcpy(olddir->dsc_a_pointer,ctx->default_name,retlen);
     }
     if (newdir != NULL) {
         struct FAB fab = cc$rms_fab;
@@ -671,32 +893,42 @@ unsigned sys_setddir(struct dsc_descriptor *newdir,unsigned short *oldlen,
         fab.fab$l_nam = &nam;
         nam.nam$b_nop |= NAM$M_SYNCHK;
         nam.nam$b_ess = DEFAULT_SIZE;
-        nam.nam$l_esa = default_buffer;
+        nam.nam$l_esa = ctx->default_buffer;
         fab.fab$b_fns = newdir->dsc_w_length;
         fab.fab$l_fna = newdir->dsc_a_pointer;
         sts = sys_parse(&fab);
         if (sts & 1) {
             if (nam.nam$b_name + nam.nam$b_type + nam.nam$b_ver > 2) return RMS$_DIR;
             if (nam.nam$l_fnb & NAM$M_WILDCARD) return RMS$_WLD;
-            default_name = default_buffer;
-            default_size[0] = nam.nam$b_dev;
-            default_size[1] = nam.nam$b_dir;
-            memcpy(default_name + nam.nam$b_dev + nam.nam$b_dir,".;",3);
+            ctx->default_name = ctx->default_buffer;
+            ctx->default_size[0] = nam.nam$b_dev;
+            ctx->default_size[1] = nam.nam$b_dir;
+            memcpy(ctx->default_name + nam.nam$b_dev + nam.nam$b_dir,".;",3);
         }
     }
     return sts;
 }
 
 
-/* This version of connect only resets record pointer */
+/* This version of connect only resets record pointer - and since
+   records will be read in order asks for file read ahead */
 
 unsigned sys_connect(struct RAB *rab)
 {
+    struct CONTEXT *ctx = ctx_current();
     rab->rab$w_rfa[0] = 0;
     rab->rab$w_rfa[1] = 0;
     rab->rab$w_rfa[2] = 0;
     rab->rab$w_rsz = 0;
     if (rab->rab$l_fab->fab$b_org == FAB$C_SEQ) {
+        int ifi_no = rab->rab$l_fab->fab$w_ifi;
+        if (ifi_no > 0 && ifi_no < IFI_MAX && ctx->ifi_table[ifi_no] != NULL) {
+            struct FCB *fcb = ctx->ifi_table[ifi_no]->wcf_fcb;
+            if ((fcb->status & FCB_WRITE) == 0) {
+                fcb->status |= FCB_PREFETCH;
+                fcb->prefetch = 0;
+            }
+        }
         return 1;
     } else {
         return SS$_NOTINSTALL;
@@ -704,34 +936,30 @@ unsigned sys_connect(struct RAB *rab)
 }
 
 
-/* Disconnect is even more boring */
+/* Disconnect is even more boring - just stop any read ahead */
 
 unsigned sys_disconnect(struct RAB *rab)
 {
+    struct CONTEXT *ctx = ctx_current();
+    int ifi_no = rab->rab$l_fab->fab$w_ifi;
+    if (ifi_no > 0 && ifi_no < IFI_MAX && ctx->ifi_table[ifi_no] != NULL) {
+        ctx->ifi_table[ifi_no]->wcf_fcb->status &= ~FCB_PREFETCH;
+    }
     return 1;
 }
 
 
-
-#define IFI_MAX 64
-struct WCCFILE *ifi_table[] = {
-    NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
-    NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
-    NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,
-    NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL,NULL
-};
-
-
 /* get for sequential files */
 
 unsigned sys_get(struct RAB *rab)
 {
+    struct CONTEXT *ctx = ctx_current();
     char *buffer,*recbuff;
     unsigned block,blocks,offset;
     unsigned cpylen,reclen;
     unsigned delim,rfm,sts;
     struct VIOC *vioc;
-    struct FCB *fcb = ifi_table[rab->rab$l_fab->fab$w_ifi]->wcf_fcb;
+    struct FCB *fcb = ctx->ifi_table[rab->rab$l_fab->fab$w_ifi]->wcf_fcb;
 
     reclen = rab->rab$w_usz;
     recbuff = rab->rab$l_ubf;
@@ -876,12 +1104,13 @@ unsigned sys_get(struct RAB *rab)
 
 unsigned sys_put(struct RAB *rab)
 {
+    struct CONTEXT *ctx = ctx_current();
     char *buffer,*recbuff;
     unsigned block,blocks,offset;
     unsigned cpylen,reclen;
     unsigned delim,rfm,sts;
     struct VIOC *vioc;
-    struct FCB *fcb = ifi_table[rab->rab$l_fab->fab$w_ifi]->wcf_fcb;
+    struct FCB *fcb = ctx->ifi_table[rab->rab$l_fab->fab$w_ifi]->wcf_fcb;
 
     reclen = rab->rab$w_rsz;
     recbuff = rab->rab$l_rbf;
@@ -999,9 +1228,10 @@ unsigned sys_put(struct RAB *rab)
 
 unsigned sys_display(struct FAB *fab)
 {
+    struct CONTEXT *ctx = ctx_current();
     struct XABDAT *xab = fab->fab$l_xab;
 
-    struct HEAD *head = ifi_table[fab->fab$w_ifi]->wcf_fcb->head;
+    struct HEAD *head = ctx->ifi_table[fab->fab$w_ifi]->wcf_fcb->head;
     unsigned short *pp = (unsigned short *) head;
     struct IDENT *id = (struct IDENT *) (pp + head->fh2$b_idoffset);
     int ifi_no = fab->fab$w_ifi;
@@ -1059,18 +1289,19 @@ unsigned sys_display(struct FAB *fab)
 
 unsigned sys_close(struct FAB *fab)
 {
+    struct CONTEXT *ctx = ctx_current();
     int sts;
     int ifi_no = fab->fab$w_ifi;
     if (ifi_no < 1 || ifi_no >= IFI_MAX) return RMS$_IFI;
-    sts = deaccessfile(ifi_table[ifi_no]->wcf_fcb);
+    sts = deaccessfile(ctx->ifi_table[ifi_no]->wcf_fcb);
     if (sts & 1) {
-        ifi_table[ifi_no]->wcf_fcb = NULL;
-        if (ifi_table[ifi_no]->wcf_status & STATUS_TMPWCC) {
-            cleanup_wcf(ifi_table[ifi_no]);
+        ctx->ifi_table[ifi_no]->wcf_fcb = NULL;
+        if (ctx->ifi_table[ifi_no]->wcf_status & STATUS_TMPWCC) {
+            cleanup_wcf(ctx->ifi_table[ifi_no]);
             if (fab->fab$l_nam != NULL) fab->fab$l_nam->nam$l_wcc = 0;
         }
         fab->fab$w_ifi = 0;
-        ifi_table[ifi_no] = NULL;
+        ctx->ifi_table[ifi_no] = NULL;
     }
     return sts;
 }
@@ -1080,13 +1311,14 @@ unsigned sys_close(struct FAB *fab)
 
 unsigned sys_open(struct FAB *fab)
 {
+    struct CONTEXT *ctx = ctx_current();
     unsigned sts;
     int ifi_no = 1;
     int wcc_flag = 0;
     struct WCCFILE *wccfile = NULL;
     struct NAM *nam = fab->fab$l_nam;
     if (fab->fab$w_ifi != 0) return RMS$_IFI;
-    while (ifi_table[ifi_no] != NULL && ifi_no < IFI_MAX) ifi_no++;
+    while (ctx->ifi_table[ifi_no] != NULL && ifi_no < IFI_MAX) ifi_no++;
     if (ifi_no >= IFI_MAX) return RMS$_IFI;
     if (nam != NULL) {
         wccfile = (struct WCCFILE *) nam->nam$l_wcc;
@@ -1109,7 +1341,7 @@ unsigned sys_open(struct FAB *fab)
                                   fab->fab$b_fac & (FAB$M_PUT | FAB$M_UPD));
     if (sts & 1) {
         struct HEAD *head = wccfile->wcf_fcb->head;
-        ifi_table[ifi_no] = wccfile;
+        ctx->ifi_table[ifi_no] = wccfile;
         fab->fab$w_ifi = ifi_no;
         if (head->fh2$w_recattr.fat$b_rtype == 0) head->fh2$w_recattr.fat$b_rtype = FAB$C_STMLF;
         sys_display(fab);
@@ -1126,13 +1358,14 @@ unsigned sys_open(struct FAB *fab)
 
 unsigned sys_erase(struct FAB *fab)
 {
+    struct CONTEXT *ctx = ctx_current();
     unsigned sts;
     int ifi_no = 1;
     int wcc_flag = 0;
     struct WCCFILE *wccfile = NULL;
     struct NAM *nam = fab->fab$l_nam;
     if (fab->fab$w_ifi != 0) return RMS$_IFI;
-    while (ifi_table[ifi_no] != NULL && ifi_no < IFI_MAX) ifi_no++;
+    while (ctx->ifi_table[ifi_no] != NULL && ifi_no < IFI_MAX) ifi_no++;
     if (ifi_no >= IFI_MAX) return RMS$_IFI;
     if (nam != NULL) {
         wccfile = (struct WCCFILE *) fab->fab$l_nam->nam$l_wcc;
@@ -1165,12 +1398,19 @@ unsigned sys_erase(struct FAB *fab)
         fibblk.fib$b_fid_rvn = 0;
         fibblk.fib$b_fid_nmx = 0;
         fibblk.fib$l_wcc = 0;
+        access_begin();         /* Entry and file go together */
         sts = direct(wccfile->wcf_vcb,&fibdsc,&serdsc,NULL,NULL,1);
         if (sts & 1) {
+            int ser_size[5];
+            name_delim(serdsc.dsc_a_pointer,serdsc.dsc_w_length,ser_size);
+            if (ser_size[3] == 4 && memcmp(serdsc.dsc_a_pointer + ser_size[2],".DIR",4) == 0) {
+                dircache_purge(wccfile->wcf_vcb);
+            }
             sts = accesserase(wccfile->wcf_vcb,&wccfile->wcf_fid);
 	} else {
 	    printf("Direct status is %d\n",sts);
 	}
+        access_end();
     }
     if (wcc_flag) {
         cleanup_wcf(wccfile);
@@ -1182,13 +1422,14 @@ unsigned sys_erase(struct FAB *fab)
 
 unsigned sys_create(struct FAB *fab)
 {
+    struct CONTEXT *ctx = ctx_current();
     unsigned sts;
     int ifi_no = 1;
     int wcc_flag = 0;
     struct WCCFILE *wccfile = NULL;
     struct NAM *nam = fab->fab$l_nam;
     if (fab->fab$w_ifi != 0) return RMS$_IFI;
-    while (ifi_table[ifi_no] != NULL && ifi_no < IFI_MAX) ifi_no++;
+    while (ctx->ifi_table[ifi_no] != NULL && ifi_no < IFI_MAX) ifi_no++;
     if (ifi_no >= IFI_MAX) return RMS$_IFI;
     if (nam != NULL) {
         wccfile = (struct WCCFILE *) fab->fab$l_nam->nam$l_wcc;
@@ -1222,6 +1463,7 @@ unsigned sys_create(struct FAB *fab)
         fibblk.fib$b_did_rvn = 0;
         fibblk.fib$b_did_nmx = 0;
         fibblk.fib$l_wcc = 0;
+        access_begin();         /* File and entry go together */
         sts = update_create(wccfile->wcf_vcb,(struct fiddef *)&fibblk.fib$w_did_num,
 		"TEST.FILE;1",(struct fiddef *)&fibblk.fib$w_fid_num,&wccfile->wcf_fcb);
         if (sts & 1)
@@ -1229,9 +1471,10 @@ unsigned sys_create(struct FAB *fab)
 		&wccfile->wcf_wcd.wcd_serdsc,NULL,NULL,2);
             if (sts & 1) {
                 sts = update_extend(wccfile->wcf_fcb,100,0);
-                ifi_table[ifi_no] = wccfile;
+                ctx->ifi_table[ifi_no] = wccfile;
                 fab->fab$w_ifi = ifi_no;
 	    }
+        access_end();
     }
     cleanup_wcf(wccfile);
     if (nam != NULL) nam->nam$l_wcc = 0;
@@ -1240,10 +1483,11 @@ unsigned sys_create(struct FAB *fab)
 
 unsigned sys_extend(struct FAB *fab)
 {
+    struct CONTEXT *ctx = ctx_current();
     int sts;
     int ifi_no = fab->fab$w_ifi;
     if (ifi_no < 1 || ifi_no >= IFI_MAX) return RMS$_IFI;
-    sts = update_extend(ifi_table[ifi_no]->wcf_fcb,
-                        fab->fab$l_alq - ifi_table[ifi_no]->wcf_fcb->hiblock,0);
+    sts = update_extend(ctx->ifi_table[ifi_no]->wcf_fcb,
+                        fab->fab$l_alq - ctx->ifi_table[ifi_no]->wcf_fcb->hiblock,0);
     return sts;
 }
@@ -28,6 +28,7 @@
 #define SS$_IVDEVNAM 324
 #define SS$_NOIOCHAN 436
 #define SS$_PARITY 500
+#define SS$_ILLBLKNUM 588
 #define SS$_WRITLCK 604
 #define SS$_BADIRECTORY 2088
 #define SS$_DEVICEFULL 2128
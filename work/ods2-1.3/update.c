@@ -19,7 +19,7 @@ struct VCBDEV *rvn_to_dev(struct VCB *vcb,unsigned rvn);
 /* Bitmaps get accesses in 'WORK_UNITs' which can be an integer
    on a little endian machine but must be a byte on a big endian system */
 
-#ifdef BIG_ENDIAN
+#ifdef HOST_BIG_ENDIAN
 #define WORK_UNIT unsigned char
 #define WORK_MASK 0xff
 #else
@@ -28,14 +28,101 @@ struct VCBDEV *rvn_to_dev(struct VCB *vcb,unsigned rvn);
 #endif
 #define WORK_BITS (sizeof(WORK_UNIT) * 8)
 
+/* Bits set in a WORK_UNIT: the compiler's builtin (a single instruction
+   where the machine has one) or else the usual parallel bit count */
+
+#ifdef __GNUC__
+#define POPCOUNT(work_val) __builtin_popcount(work_val)
+#else
+#define POPCOUNT(work_val) popcount(work_val)
+
+unsigned popcount(register unsigned work_val)
+{
+    work_val = work_val - ((work_val >> 1) & 0x55555555);
+    work_val = (work_val & 0x33333333) + ((work_val >> 2) & 0x33333333);
+    work_val = (work_val + (work_val >> 4)) & 0x0f0f0f0f;
+    return (work_val * 0x01010101) >> 24;
+}
+#endif
+
+/* Trailing clear bits in a (non-zero) WORK_UNIT: the lowest set bit less
+   one leaves just those bits set to be counted */
+
+#ifdef __GNUC__
+#define CTZ(work_val) __builtin_ctz(work_val)
+#else
+#define CTZ(work_val) POPCOUNT(((work_val) & -(work_val)) - 1)
+#endif
+
+/* The cluster bitmap is also kept summarised a block (4096 clusters) at
+   a time: the free clusters at each end of the block and the longest
+   free run within it. bitmap_search() walks the summary rather than the
+   bitmap, and bitmap_modify() refreshes the blocks it changes */
+
+struct MAPSUM {
+    unsigned short first;       /* Free clusters at start of block */
+    unsigned short last;        /* Free clusters at end of block */
+    unsigned short longest;     /* Longest free run in block */
+    unsigned short where;       /* ...and where it starts */
+};
+
+/* bitmap_summary() to summarise one block of the cluster bitmap */
+
+void bitmap_summary(WORK_UNIT *bitmap,struct MAPSUM *mapsum)
+{
+    register unsigned work_count = 4096 / WORK_BITS;
+    register unsigned cluster = 0,run = 0;
+    register int in_first = 1;
+    mapsum->first = 0;
+    mapsum->longest = 0;
+    mapsum->where = 0;
+    do {
+        register WORK_UNIT work_val = *bitmap++;
+        register unsigned bit_no;
+        if (work_val == WORK_MASK) {
+            run += WORK_BITS;
+            cluster += WORK_BITS;
+            continue;
+        }
+        for (bit_no = 0; bit_no < WORK_BITS; bit_no++) {
+            if (work_val & 1) {
+                run++;
+            } else {
+                if (in_first) {
+                    mapsum->first = run;
+                    in_first = 0;
+                }
+                if (run > mapsum->longest) {
+                    mapsum->longest = run;
+                    mapsum->where = cluster - run;
+                }
+                run = 0;
+            }
+            work_val = work_val >> 1;
+            cluster++;
+        }
+    } while (--work_count > 0);
+    if (in_first) mapsum->first = run;
+    if (run > mapsum->longest) {
+        mapsum->longest = run;
+        mapsum->where = cluster - run;
+    }
+    mapsum->last = run;
+}
+
 /* update_freecount() to read the device cluster bitmap and compute
-   the number of un-used clusters */
+   the number of un-used clusters (and summarise the bitmap) */
 
 unsigned update_freecount(struct VCBDEV *vcbdev,unsigned *retcount)
 {
     register unsigned sts;
     register unsigned free_clusters = 0;
     register unsigned map_block, map_end = (vcbdev->max_cluster + 4095) / 4096 + 2;
+    if (vcbdev->mapsum == NULL) {
+        vcbdev->mapsum = (struct MAPSUM *) malloc((map_end - 2) * sizeof(struct MAPSUM));
+        if (vcbdev->mapsum == NULL) return SS$_INSFMEM;
+        vcbdev->mapblocks = map_end - 2;
+    }
     for (map_block = 2; map_block < map_end; ) {
         struct VIOC *vioc;
         unsigned blkcount;
@@ -47,16 +134,13 @@ unsigned update_freecount(struct VCBDEV *vcbdev,unsigned *retcount)
         work_ptr = bitmap;
         work_count = blkcount * 512 / sizeof(WORK_UNIT);
         do {
-            register WORK_UNIT work_val = *work_ptr++;
-            if (work_val == WORK_MASK) {
-                free_clusters += WORK_BITS;
-            } else {
-                while (work_val != 0) {
-                    if (work_val & 1) free_clusters++;
-                    work_val = work_val >> 1;
-                }
-            }
+            free_clusters += POPCOUNT(*work_ptr++);
         } while (--work_count > 0);
+        for (work_count = 0; work_count < blkcount; work_count++) {
+            if (map_block - 2 + work_count >= vcbdev->mapblocks) break;
+            bitmap_summary(bitmap + work_count * (4096 / WORK_BITS),
+                           &vcbdev->mapsum[map_block - 2 + work_count]);
+        }
         sts = deaccesschunk(vioc,0,0,1);
         if (!(sts & 1)) return sts;
         map_block += blkcount;
@@ -65,6 +149,30 @@ unsigned update_freecount(struct VCBDEV *vcbdev,unsigned *retcount)
     return sts;
 }
 
+/* update_getfree() returns the free clusters on a device. Mount leaves
+   them uncounted so the bitmap is only read when space is first wanted;
+   failing to read it is an error rather than a full device */
+
+unsigned update_getfree(struct VCBDEV *vcbdev,unsigned *retfree)
+{
+    register unsigned sts = SS$_NORMAL;
+    cache_lock();
+    if (vcbdev->free_clusters == FREE_UNKNOWN) {
+        unsigned free_clusters;
+        sts = update_freecount(vcbdev,&free_clusters);
+        if (sts & 1) vcbdev->free_clusters = free_clusters;
+    }
+    if (sts & 1) *retfree = vcbdev->free_clusters;
+    cache_unlock();
+    return sts;
+}
+
+/* The bitmap, its summary and free count, and the header batch are
+   shared by every context on a volume, so the routines which allocate
+   or release clusters and headers hold the cache lock while they look
+   and change them. They are normally called within an operation (see
+   access_begin()), which holds it already */
+
 /* bitmap_modify() will either set or release a block of bits in the
    device cluster bitmap */
 
@@ -77,14 +185,16 @@ unsigned bitmap_modify(struct VCBDEV *vcbdev,unsigned cluster,unsigned count,
     register unsigned block_offset = cluster % 4096;
     if (clust_count < 1) return SS$_BADPARAM;
     if (cluster + clust_count > vcbdev->max_cluster + 1) return SS$_BADPARAM;
+    cache_lock();
     do {
         struct VIOC *vioc;
         unsigned blkcount;
         WORK_UNIT *bitmap;
         register WORK_UNIT *work_ptr;
         register unsigned work_count;
+        unsigned start_offset = block_offset,start_count = clust_count;
         sts = accesschunk(vcbdev->mapfcb,map_block,&vioc,(char **) &bitmap,&blkcount,1);
-        if (!(sts & 1)) return sts;
+        if (!(sts & 1)) break;
         work_ptr = bitmap + block_offset / WORK_BITS;
         if (block_offset % WORK_BITS) {
             register unsigned bit_no = block_offset % WORK_BITS;
@@ -112,7 +222,7 @@ unsigned bitmap_modify(struct VCBDEV *vcbdev,unsigned cluster,unsigned count,
         }
         clust_count -= work_count * WORK_BITS;
         if (release_flag) {
-            while (clust_count-- > 0) {
+            while (work_count-- > 0) {
                 *work_ptr++ = WORK_MASK;
             }
         } else {
@@ -129,90 +239,93 @@ unsigned bitmap_modify(struct VCBDEV *vcbdev,unsigned cluster,unsigned count,
             }
             clust_count = 0;
         }
+        if (vcbdev->mapsum != NULL) {
+            register unsigned block,blocks;
+            blocks = (start_offset + start_count - clust_count + 4095) / 4096;
+            for (block = 0; block < blocks && block < blkcount; block++) {
+                if (map_block - 2 + block >= vcbdev->mapblocks) break;
+                bitmap_summary(bitmap + block * (4096 / WORK_BITS),
+                               &vcbdev->mapsum[map_block - 2 + block]);
+            }
+        }
         sts = deaccesschunk(vioc,map_block,blkcount,1);
-        if (!(sts & 1)) return sts;
+        if (!(sts & 1)) break;
         map_block += blkcount;
         block_offset = 0;
     } while (clust_count != 0);
+    if ((sts & 1) && vcbdev->free_clusters != FREE_UNKNOWN) {
+        if (release_flag) {
+            vcbdev->free_clusters += count;
+        } else {
+            vcbdev->free_clusters -= count;
+        }
+    }
+    cache_unlock();
     return sts;
 }
 
 /* bitmap_search() is a routine to find a pool of free clusters in the
-   device cluster bitmap */
+   device cluster bitmap. It takes the first run long enough from the
+   starting position on (wrapping around), else the longest found, by
+   walking the bitmap summary a block at a time */
 
 unsigned bitmap_search(struct VCBDEV *vcbdev,unsigned *position,unsigned *count)
 {
-    register unsigned sts;
-    register unsigned map_block,block_offset;
-    register unsigned search_words,needed;
-    register unsigned run = 0,cluster;
+    register unsigned needed = *count;
+    register unsigned group,start_group;
+    register unsigned run = 0,run_start = 0;
     register unsigned best_run = 0,best_cluster = 0;
-    needed = *count;
     if (needed < 1 || needed > vcbdev->max_cluster + 1) return SS$_BADPARAM;
-    cluster = *position;
-    if (cluster + *count > vcbdev->max_cluster + 1) cluster = 0;
-    map_block = cluster / 4096 + 2;
-    block_offset = cluster % 4096;
-    cluster = cluster - (cluster % WORK_BITS);
-    search_words = vcbdev->max_cluster / WORK_BITS;
+    cache_lock();
+    if (vcbdev->mapsum == NULL || vcbdev->free_clusters == FREE_UNKNOWN) {
+        unsigned free_clusters;
+        register unsigned sts = update_freecount(vcbdev,&free_clusters);
+        if ((sts & 1) == 0) {
+            cache_unlock();
+            return sts;
+        }
+        vcbdev->free_clusters = free_clusters;
+    }
+    start_group = *position / 4096;
+    if (*position + needed > vcbdev->max_cluster + 1 ||
+        start_group >= vcbdev->mapblocks) start_group = 0;
+    group = start_group;
     do {
-        struct VIOC *vioc;
-        unsigned blkcount;
-        WORK_UNIT *bitmap;
-        register WORK_UNIT *work_ptr, work_val;
-        register unsigned work_count;
-        sts = accesschunk(vcbdev->mapfcb,map_block,&vioc,(char **) &bitmap,&blkcount,1);
-        if ((sts & 1) == 0) return sts;
-        work_ptr = bitmap + block_offset / WORK_BITS;
-        work_val = *work_ptr++;
-        if (block_offset % WORK_BITS) {
-            work_val = work_val && (WORK_MASK << block_offset % WORK_BITS);
-        }        
-        work_count = (blkcount * 4096 - block_offset) / WORK_BITS;
-        if (work_count > search_words) work_count = search_words;
-        search_words -= work_count;
-        do {
-            if (work_val == WORK_MASK) {
-                run += WORK_BITS;
-            } else {
-                register unsigned bit_no = 0;
-                while (work_val != 0) {
-                    if (work_val & 1) {
-                        run++;
-                    } else {
-                        if (run > best_run) {
-                            best_run = run;
-                            best_cluster = cluster + bit_no;
-                        }
-                        run = 0;
-                    }
-                    work_val = work_val >> 1;
-                    bit_no++;
-                }
-                if (bit_no < WORK_BITS) {
-                    if (run > best_run) {
-                        best_run = run;
-                        best_cluster = cluster + bit_no;
-                    }
-                    run = 0;
-                }
-            }
-            cluster += WORK_BITS;
-            if (work_count-- > 0) {
-                work_val = *work_ptr++;
-            } else {
-                break;
-            }
-        } while (best_run < needed);
-        deaccesschunk(vioc,map_block,0,1);
-        if ((sts & 1) == 0) break;
-        map_block += blkcount;
-        block_offset = 0;
-    } while (best_run < needed && search_words != 0);
-    if (best_run > needed) best_run = needed;
+        register struct MAPSUM *mapsum = &vcbdev->mapsum[group];
+        if (run == 0) run_start = group * 4096;
+        if (run + mapsum->first >= needed) {
+            best_run = needed;
+            best_cluster = run_start;
+            break;
+        }
+        if (mapsum->longest >= needed) {
+            best_run = needed;
+            best_cluster = group * 4096 + mapsum->where;
+            break;
+        }
+        if (run + mapsum->first > best_run) {
+            best_run = run + mapsum->first;
+            best_cluster = run_start;
+        }
+        if (mapsum->longest > best_run) {
+            best_run = mapsum->longest;
+            best_cluster = group * 4096 + mapsum->where;
+        }
+        if (mapsum->first == 4096) {
+            run += 4096;
+        } else {
+            run = mapsum->last;
+            run_start = group * 4096 + 4096 - run;
+        }
+        if (++group >= vcbdev->mapblocks) {
+            group = 0;
+            run = 0;
+        }
+    } while (group != start_group);
+    cache_unlock();
     *count = best_run;
     *position = best_cluster;
-    return sts;
+    return SS$_NORMAL;
 }
 
 /* headmap_clear() will release a header from the indexf.sys file header
@@ -233,64 +346,125 @@ unsigned headmap_clear(struct VCBDEV *vcbdev,unsigned head_no)
     return sts;
 }
 
-/* update_findhead() will locate a free header from indexf.sys */
+/* update_headbatch() finds the next batch of free headers for
+   update_findhead(). Clear bits of the index file bitmap are picked out
+   a word at a time (count trailing zeros on the complement) and the
+   candidate headers are then checked together, each index file chunk
+   read once. Headers that turn out to be in use are marked so in the
+   bitmap; the good ones go to vcbdev->headfree[] lowest last. When
+   deallocfile() frees a header below vcbdev->headnext it moves the scan
+   back and drops the batch, so the lowest free header is used first */
 
-unsigned update_findhead(struct VCBDEV *vcbdev,unsigned *rethead_no,
-                         struct VIOC **retvioc,struct HEAD **headbuff,
-                         unsigned *retidxblk)
+unsigned update_headbatch(struct VCBDEV *vcbdev)
 {
-    unsigned head_no = 0;
-    register unsigned sts;
-    do {
+    register unsigned sts = SS$_NORMAL;
+    register unsigned head_no = vcbdev->headnext;
+    register unsigned maxfiles = VMSLONG(vcbdev->home.hm2$l_maxfiles);
+    register unsigned firstblk = VMSWORD(vcbdev->home.hm2$w_ibmapvbn) +
+                                 VMSWORD(vcbdev->home.hm2$w_ibmapsize);
+    head_no -= head_no % WORK_BITS;
+    while (vcbdev->headcount == 0 && head_no < maxfiles) {
         struct VIOC *vioc;
-        int modify_flag = 0;
-        unsigned blkcount;
-        WORK_UNIT *bitmap,*work_ptr;
+        WORK_UNIT *bitmap;
+        unsigned candidate[HEAD_BATCH];
+        register unsigned count = 0,check;
         register unsigned map_block,work_count;
+        int modify_flag = 0;
         map_block = head_no / 4096 + vcbdev->home.hm2$w_cluster * 4 + 1;
-        sts = accesschunk(vcbdev->idxfcb,map_block,
-            &vioc,(char **) &bitmap,&blkcount,1);
-        if ((sts & 1) == 0) return sts;
+        sts = accesschunk(vcbdev->idxfcb,map_block,&vioc,(char **) &bitmap,NULL,1);
+        if ((sts & 1) == 0) break;
         work_count = (head_no % 4096) / WORK_BITS;
-        work_ptr = bitmap + work_count;
-        work_count = blkcount * 512 / WORK_BITS - work_count;
         do {
-            register WORK_UNIT work_val = *work_ptr;
-            if (work_val == WORK_MASK) {
-                head_no += WORK_BITS;
-            } else {
-                register unsigned bit_no = 0;
-                for (bit_no = 0; bit_no < WORK_BITS; bit_no++) {
-                    if ((work_val & (1 << bit_no)) == 0) {
-                        register unsigned idxblk = head_no +
-                            VMSWORD(vcbdev->home.hm2$w_ibmapvbn) +
-                            VMSWORD(vcbdev->home.hm2$w_ibmapsize);
-                        sts = accesschunk(vcbdev->idxfcb,idxblk,retvioc,(char **) headbuff,NULL,1);
-                        if (sts & 1) {
-                            *work_ptr |= 1 << bit_no;
-                            modify_flag = 1;
-                            if ((*headbuff)->fh2$w_checksum != 0 || (*headbuff)->fh2$w_fid.fid$w_num != 0 ||
-                                VMSLONG((*headbuff)->fh2$l_filechar) & FH2$M_MARKDEL == 0) {
-                                sts = deaccesschunk(*retvioc,0,0,0);
-                            } else {
-                                *rethead_no = head_no + 1;
-                                *retidxblk = idxblk;
-                                deaccesschunk(vioc,map_block,blkcount,modify_flag);
-                                return SS$_NORMAL;
-                            }
-                        }
-                    }
-                    head_no++;
+            register WORK_UNIT work_val = ~bitmap[work_count];
+            while (work_val != 0 && count < HEAD_BATCH) {
+                register unsigned bit_no = CTZ(work_val);
+                if (head_no + bit_no >= maxfiles) break;
+                candidate[count++] = head_no + bit_no;
+                work_val &= work_val - 1;
+            }
+            if (count >= HEAD_BATCH) break;
+            head_no += WORK_BITS;
+        } while (++work_count < 4096 / WORK_BITS && head_no < maxfiles);
+
+        /* Check the candidates a chunk of headers at a time... */
+
+        for (check = 0; check < count; ) {
+            struct VIOC *headvioc;
+            char *headbuff;
+            unsigned headblks;
+            register unsigned idxblk = candidate[check] + firstblk;
+            sts = accesschunk(vcbdev->idxfcb,idxblk,&headvioc,&headbuff,&headblks,0);
+            if ((sts & 1) == 0) break;
+            do {
+                register struct HEAD *head;
+                head = (struct HEAD *) (headbuff + (candidate[check] + firstblk - idxblk) * 512);
+                if (head->fh2$w_checksum != 0 || head->fh2$w_fid.fid$w_num != 0) {
+                    bitmap[(candidate[check] % 4096) / WORK_BITS] |= 1 << (candidate[check] % WORK_BITS);
+                    modify_flag = 1;
+                    candidate[check] = 0xffffffff;
                 }
+                check++;
+            } while (check < count && candidate[check] + firstblk < idxblk + headblks);
+            deaccesschunk(headvioc,0,0,0);
+        }
+        if (modify_flag) {
+            deaccesschunk(vioc,map_block,1,1);
+        } else {
+            deaccesschunk(vioc,0,0,0);
+        }
+
+        /* Keep those that passed; stop short of any that couldn't be read */
+
+        if (check < count) head_no = candidate[check];
+        vcbdev->headnext = head_no;
+        while (check-- > 0) {
+            if (candidate[check] != 0xffffffff) {
+                vcbdev->headfree[vcbdev->headcount++] = candidate[check];
             }
-            work_ptr++;
-        } while (--work_count != 0);
-        deaccesschunk(vioc,map_block,blkcount,modify_flag);
+        }
         if ((sts & 1) == 0) break;
-    } while (head_no < VMSLONG(vcbdev->home.hm2$l_maxfiles));
+    }
+    if (vcbdev->headcount == 0 && (sts & 1)) sts = SS$_DEVICEFULL;
     return sts;
 }
 
+/* update_findhead() will locate a free header from indexf.sys */
+
+unsigned update_findhead(struct VCBDEV *vcbdev,unsigned *rethead_no,
+                         struct VIOC **retvioc,struct HEAD **headbuff,
+                         unsigned *retidxblk)
+{
+    struct VIOC *vioc;
+    WORK_UNIT *bitmap;
+    register unsigned head_no,map_block,idxblk;
+    register unsigned sts;
+    cache_lock();
+    if (vcbdev->headcount == 0) {
+        sts = update_headbatch(vcbdev);
+        if (vcbdev->headcount == 0) {
+            cache_unlock();
+            return sts;
+        }
+    }
+    head_no = vcbdev->headfree[--vcbdev->headcount];
+    map_block = head_no / 4096 + vcbdev->home.hm2$w_cluster * 4 + 1;
+    sts = accesschunk(vcbdev->idxfcb,map_block,&vioc,(char **) &bitmap,NULL,1);
+    if ((sts & 1) == 0) {
+        cache_unlock();
+        return sts;
+    }
+    bitmap[(head_no % 4096) / WORK_BITS] |= 1 << (head_no % WORK_BITS);
+    deaccesschunk(vioc,map_block,1,1);
+    cache_unlock();
+    idxblk = head_no + VMSWORD(vcbdev->home.hm2$w_ibmapvbn) +
+             VMSWORD(vcbdev->home.hm2$w_ibmapsize);
+    sts = accesschunk(vcbdev->idxfcb,idxblk,retvioc,(char **) headbuff,NULL,1);
+    if ((sts & 1) == 0) return sts;
+    *rethead_no = head_no + 1;
+    *retidxblk = idxblk;
+    return SS$_NORMAL;
+}
+
 unsigned update_addhead(struct VCB *vcb,char *filename,struct fiddef *back,
                      unsigned seg_num,struct fiddef *fid,
                      struct VIOC **vioc,struct HEAD **rethead,
@@ -304,8 +478,11 @@ unsigned update_addhead(struct VCB *vcb,char *filename,struct fiddef *back,
     struct VCBDEV *vcbdev = NULL;
     for (device = 0; device < vcb->devices; device++) {
         if (vcb->vcbdev[device].dev != NULL) {
-            if (vcb->vcbdev[device].free_clusters > free_space) {
-                free_space = vcb->vcbdev[device].free_clusters;
+            unsigned free_clusters;
+            sts = update_getfree(&vcb->vcbdev[device],&free_clusters);
+            if (!(sts & 1)) return sts;
+            if (free_clusters > free_space) {
+                free_space = free_clusters;
                 vcbdev = &vcb->vcbdev[device];
                 rvn = device;
             }
@@ -366,17 +543,22 @@ unsigned update_create(struct VCB *vcb,struct fiddef *did,char *filename,
     struct HEAD *head;
     unsigned idxblk;
     register unsigned sts;
+    access_begin();
     sts = update_addhead(vcb,filename,did,0,fid,&vioc,&head,&idxblk);
-    if (!(sts & 1)) return sts;
-    sts = deaccesshead(vioc,head,idxblk);
-    if (sts & 1 && fcb != NULL) {
-        sts = accessfile(vcb,fid,fcb,1);
+    if (sts & 1) {
+        sts = deaccesshead(vioc,head,idxblk);
+        if (sts & 1 && fcb != NULL) {
+            sts = accessfile(vcb,fid,fcb,1);
+        }
+        printf("(%d,%d,%d) %d\n",fid->fid$w_num,fid->fid$w_seq,fid->fid$b_rvn,sts);
     }
-    printf("(%d,%d,%d) %d\n",fid->fid$w_num,fid->fid$w_seq,fid->fid$b_rvn,sts);
+    access_end();
     return sts;
 }
 
-unsigned update_extend(struct FCB *fcb,unsigned blocks,unsigned contig)
+/* do_extend() allocates clusters for update_extend() */
+
+unsigned do_extend(struct FCB *fcb,unsigned blocks,unsigned contig)
 {
     register unsigned sts;
     struct VCBDEV *vcbdev;
@@ -384,7 +566,7 @@ unsigned update_extend(struct FCB *fcb,unsigned blocks,unsigned contig)
     struct HEAD *head;
     unsigned headvbn;
     struct fiddef hdrfid;
-    unsigned hdrseq;
+    unsigned hdrseq,free_clusters;
     unsigned start_pos = 0;
     unsigned block_count = blocks;
     if (block_count < 1) return 0;
@@ -407,7 +589,12 @@ unsigned update_extend(struct FCB *fcb,unsigned blocks,unsigned contig)
         start_pos = 0;          /* filenum * 3 /indexfsize * volumesize; */
     }
     if (vioc == NULL) vcbdev = rvn_to_dev(fcb->vcb,fcb->rvn);
-    if (vcbdev->free_clusters == 0 || head->fh2$b_map_inuse + 4 >=
+    sts = update_getfree(vcbdev,&free_clusters);
+    if (!(sts & 1)) {
+        if (vioc != NULL) deaccesshead(vioc,head,headvbn);
+        return sts;
+    }
+    if (free_clusters == 0 || head->fh2$b_map_inuse + 4 >=
                 head->fh2$b_acoffset - head->fh2$b_mpoffset) {
         struct VIOC *nvioc;
         struct HEAD *nhead;
@@ -437,12 +624,24 @@ unsigned update_extend(struct FCB *fcb,unsigned blocks,unsigned contig)
             fcb->hiblock += block_count * vcbdev->clustersize;
             fcb->head->fh2$w_recattr.fat$l_hiblk = VMSSWAP(fcb->hiblock * vcbdev->clustersize);
             sts = bitmap_modify(vcbdev,start_pos,block_count,0);
+            cache_remove((struct CACHE *) fcb->wcb);    /* File map is now stale */
         }
     }
     if (vioc != NULL) deaccesshead(vioc,head,headvbn);
     return sts;
 }
 
+/* update_extend() will extend a file as one operation */
+
+unsigned update_extend(struct FCB *fcb,unsigned blocks,unsigned contig)
+{
+    register unsigned sts;
+    access_begin();
+    sts = do_extend(fcb,blocks,contig);
+    access_end();
+    return sts;
+}
+
 
 
 
@@ -457,6 +656,7 @@ unsigned deallocfile(struct FCB *fcb)
     First mark all file clusters as free in BITMAP.SYS
     */
     register unsigned vbn = 1;
+    access_begin();
     while (vbn <= fcb->hiblock) {
         register unsigned sts;
         unsigned phyblk,phylen;
@@ -495,6 +695,10 @@ unsigned deallocfile(struct FCB *fcb)
                 bitmap[(filenum % 4096) / WORK_BITS] &=
                     ~(1 << (filenum % WORK_BITS));
                 sts = deaccesschunk(vioc,idxblk,1,1);
+                if (filenum < vcbdev->headnext) {
+                    vcbdev->headnext = filenum;     /* Rescan from here */
+                    vcbdev->headcount = 0;
+                }
             } else {
                 break;
             }
@@ -524,6 +728,7 @@ unsigned deallocfile(struct FCB *fcb)
             cache_delete(&fcb->cache);
         }
     }
+    access_end();
     return sts;
 }
 
@@ -535,12 +740,14 @@ unsigned accesserase(struct VCB * vcb,struct fiddef * fid)
 {
     struct FCB *fcb;
     register int sts;
+    access_begin();
     sts = accessfile(vcb,fid,&fcb,1);
     if (sts & 1) {
         fcb->head->fh2$l_filechar |= FH2$M_MARKDEL;
         printf("Accesserase ... \n");
         sts = deaccessfile(fcb);
     }
+    access_end();
     return sts;
 }
 